@@ -28,22 +28,40 @@
 #include <stdio.h>
 #include <assert.h>
 #include <vector>
+#include <algorithm>
 #include <errno.h>
+#include <string.h>
 
 #include "DTSTypes.h"
 #include "DTSBase.h"
 #include "DTSShape.h"
+#include "DTSMath.h"
+#include "DTSMeshTools.h"
+#include "DTSSkeleton.h"
+#include "DTSSkinning.h"
+#include "DTSExportOptions.h"
+#include "DTSMerge.h"
+#include "DTSAnimation.h"
 
 #include <fbxsdk.h>
 #include <math.h>
 
 #include <map>
+#include <set>
 
 #ifdef WIN32
 #define strncasecmp strnicmp
 #endif
 
-KFbxXMatrix* AxisRotation = NULL;
+class FBXInstance
+{
+public:
+    const DTSMesh* mesh;
+    KFbxNode*      node;
+};
+
+struct FBXNodeKeys;
+struct FBXAnimationBatch;
 
 class FBXExporter
 {
@@ -53,20 +71,52 @@ public:
 
     std::vector<KFbxSurfaceMaterial*> materials;
     std::vector<KFbxNode*>            skeletonNodes;
+    DTSSkeletonPose                   bindPose;
+    DTSExportOptions                  options;
+    std::vector<bool>                 mergedObjects;
+    DTSSkinStreamFile                 skinStreams;
+
+    std::map<uint64_t, std::vector<FBXInstance> > instances;
+    int                                           exportedMeshes;
+    int                                           instancedMeshes;
+
+    int sampledKeys;
+    int writtenKeys;
+
+    int addedStacks;
+    int replacedStacks;
+    int unchangedStacks;
+
+    // Name lookups of sequence file nodes, indexed once per scene and shape.
+    DTSNodeMap                        nodeMap;
+    std::map<std::string, KFbxNode*>  sceneNodes;
+    bool                              sceneNodesIndexed;
+    std::set<std::string>             missingSceneNodes;
+    std::set<std::string>             missingShapeNodes;
     
 public:
     FBXExporter(const DTSShape* shape);
+    ~FBXExporter();
 
 public:
-    bool load(const char* fbxFile);
+    bool load(const char* fbxFile, bool skeletonOnly = false);
     bool save(const char* fbxFile);
 
 public:
-    void convertMesh     (const DTSShape& shape, const DTSMesh& mesh, KFbxNode* node);
+    void convertMesh     (const DTSShape& shape, const DTSMesh& mesh, KFbxNode* node, bool createSkeleton = true);
+    void convertMeshNode (const DTSShape& shape, const DTSMesh& mesh, KFbxNode* node);
     bool convertObject   (const DTSShape& shape, const DTSSubshape& subshape, const DTSObject& object, KFbxNode* parentNode);
     bool convertSubshape (const DTSShape& shape, const DTSSubshape& subshape, KFbxNode* parentNode);
+    void convertMerged   (const DTSShape& shape, int subshapeIndex, KFbxNode* parentNode);
     bool convertSkeleton (const DTSShape& shape, KFbxNode* parentNode, const std::vector<int>& nodeIndexes);
-    void convertAnimation(const DTSShape& shape, const DTSShape& file, const DTSSequence& sequence);
+    void convertAnimations(const DTSShape& shape, const DTSShape& file, int sequenceIndex = -1);
+    void prepareAnimations(const DTSShape& shape, const DTSShape& file, int sequenceIndex, FBXAnimationBatch& batch);
+    void commitAnimations (FBXAnimationBatch& batch);
+    void findSkeletonNodes(const DTSShape& file);
+    void reportMissingNodes();
+
+    KFbxAnimStack* findAnimStack(const char* name);
+    void commitNodeKeys   (const FBXNodeKeys& task);
 
     KFbxSurfaceMaterial* convertMaterial(const DTSResolver& resolver, const DTSShape& shape, const DTSMaterial& material);
     KFbxTexture*         createTexture(const char* name);
@@ -74,13 +124,23 @@ public:
     void convertNodePositionAndRotation(const DTSShape& shape, int nodeIndex, KFbxNode* node, bool invertYZ = false);
 
     static void convert(const Point&      pt,  KFbxVector4& v, bool invertYZ = false);
-    static void convert(const Quaternion& rot, KFbxVector4& v);
+    static void convert(const Quaternion& rot, KFbxVector4& v, bool invertYZ = false);
 };
 
 FBXExporter::FBXExporter(const DTSShape* shape)
 {
     sdkManager = KFbxSdkManager::Create();
     scene      = KFbxScene::Create(sdkManager, "");
+
+    exportedMeshes  = 0;
+    instancedMeshes = 0;
+    sampledKeys     = 0;
+    writtenKeys     = 0;
+    addedStacks     = 0;
+    replacedStacks  = 0;
+    unchangedStacks = 0;
+
+    sceneNodesIndexed = false;
     
     if (shape)
     {
@@ -90,315 +150,75 @@ FBXExporter::FBXExporter(const DTSShape* shape)
         {
             skeletonNodes.push_back(NULL);
         }
+
+        bindPose.computeBindPose(*shape);
+        nodeMap.build(*shape);
     }
+}
 
-    AxisRotation = new KFbxXMatrix();
-    (*AxisRotation)[0][0] = -1; (*AxisRotation)[0][1] = 0; (*AxisRotation)[0][2] = 0; (*AxisRotation)[0][3] = 0;
-    (*AxisRotation)[1][0] =  0; (*AxisRotation)[1][1] = 0; (*AxisRotation)[1][2] = 1; (*AxisRotation)[1][3] = 0;
-    (*AxisRotation)[2][0] =  0; (*AxisRotation)[2][1] = 1; (*AxisRotation)[2][2] = 0; (*AxisRotation)[2][3] = 0;
-    (*AxisRotation)[3][0] =  0; (*AxisRotation)[3][1] = 0; (*AxisRotation)[3][2] = 0; (*AxisRotation)[3][3] = 1;
+FBXExporter::~FBXExporter()
+{
+    sdkManager->Destroy();
 }
 
 void FBXExporter::convert(const Point& pt, KFbxVector4& v, bool invertYZ)
 {
-    v.Set(pt.x * 100.0, pt.y * 100.0, pt.z * 100.0);
+    Point p(pt);
 
     if (invertYZ)
     {
-        KFbxXMatrix mat;
-        
-        mat.SetT(v);
-        mat = (*AxisRotation) * mat;
-        v   = mat.GetT();
+        DTSMath::swapAxis(p);
     }
+
+    v.Set(p.x * 100.0, p.y * 100.0, p.z * 100.0);
 }
 
-void FBXExporter::convert(const Quaternion& q, KFbxVector4& v)
+void FBXExporter::convert(const Quaternion& q, KFbxVector4& v, bool invertYZ)
 {
-    KFbxQuaternion dtsQ(q.x, q.y, q.z, q.w);
-    KFbxXMatrix    dtsMat, fbxMat;
-    
-    dtsMat.SetQ(dtsQ);
-    
-    fbxMat = dtsMat;
-    fbxMat[0][1] = dtsMat[1][0];
-    fbxMat[0][2] = dtsMat[2][0];
-    fbxMat[1][0] = dtsMat[0][1];
-    fbxMat[1][2] = dtsMat[2][1];
-    fbxMat[2][0] = dtsMat[0][2];
-    fbxMat[2][1] = dtsMat[1][2];
-    v = fbxMat.GetR();
+    float x, y, z;
+
+    DTSMath::quaternionToEuler(q, invertYZ, x, y, z);
+    v.Set(x, y, z);
 }
 
-const KFbxVector4 NormalTable[] =
+// Drops every node attribute but skeletons, keeping the hierarchy.
+static void stripAttributes(KFbxNode* node)
 {
-    KFbxVector4(  0.565061f, -0.270644f, -0.779396f ),
-    KFbxVector4( -0.309804f, -0.731114f,  0.607860f ),
-    KFbxVector4( -0.867412f,  0.472957f,  0.154619f ),
-    KFbxVector4( -0.757488f,  0.498188f, -0.421925f ),
-    KFbxVector4(  0.306834f, -0.915340f,  0.260778f ),
-    KFbxVector4(  0.098754f,  0.639153f, -0.762713f ),
-    KFbxVector4(  0.713706f, -0.558862f, -0.422252f ),
-    KFbxVector4( -0.890431f, -0.407603f, -0.202466f ),
-    KFbxVector4(  0.848050f, -0.487612f, -0.207475f ),
-    KFbxVector4( -0.232226f,  0.776855f,  0.585293f ),
-    KFbxVector4( -0.940195f,  0.304490f, -0.152706f ),
-    KFbxVector4(  0.602019f, -0.491878f, -0.628991f ),
-    KFbxVector4( -0.096835f, -0.494354f, -0.863850f ),
-    KFbxVector4(  0.026630f, -0.323659f, -0.945799f ),
-    KFbxVector4(  0.019208f,  0.909386f,  0.415510f ),
-    KFbxVector4(  0.854440f,  0.491730f,  0.167731f ),
-    KFbxVector4( -0.418835f,  0.866521f, -0.271512f ),
-    KFbxVector4(  0.465024f,  0.409667f,  0.784809f ),
-    KFbxVector4( -0.674391f, -0.691087f, -0.259992f ),
-    KFbxVector4(  0.303858f, -0.869270f, -0.389922f ),
-    KFbxVector4(  0.991333f,  0.090061f, -0.095640f ),
-    KFbxVector4( -0.275924f, -0.369550f,  0.887298f ),
-    KFbxVector4(  0.426545f, -0.465962f,  0.775202f ),
-    KFbxVector4( -0.482741f, -0.873278f, -0.065920f ),
-    KFbxVector4(  0.063616f,  0.932012f, -0.356800f ),
-    KFbxVector4(  0.624786f, -0.061315f,  0.778385f ),
-    KFbxVector4( -0.530300f,  0.416850f,  0.738253f ),
-    KFbxVector4(  0.312144f, -0.757028f, -0.573999f ),
-    KFbxVector4(  0.399288f, -0.587091f, -0.704197f ),
-    KFbxVector4( -0.132698f,  0.482877f,  0.865576f ),
-    KFbxVector4(  0.950966f,  0.306530f,  0.041268f ),
-    KFbxVector4( -0.015923f, -0.144300f,  0.989406f ),
-    KFbxVector4( -0.407522f, -0.854193f,  0.322925f ),
-    KFbxVector4( -0.932398f,  0.220464f,  0.286408f ),
-    KFbxVector4(  0.477509f,  0.876580f,  0.059936f ),
-    KFbxVector4(  0.337133f,  0.932606f, -0.128796f ),
-    KFbxVector4( -0.638117f,  0.199338f,  0.743687f ),
-    KFbxVector4( -0.677454f,  0.445349f,  0.585423f ),
-    KFbxVector4( -0.446715f,  0.889059f, -0.100099f ),
-    KFbxVector4( -0.410024f,  0.909168f,  0.072759f ),
-    KFbxVector4(  0.708462f,  0.702103f, -0.071641f ),
-    KFbxVector4( -0.048801f, -0.903683f, -0.425411f ),
-    KFbxVector4( -0.513681f, -0.646901f,  0.563606f ),
-    KFbxVector4( -0.080022f,  0.000676f, -0.996793f ),
-    KFbxVector4(  0.066966f, -0.991150f, -0.114615f ),
-    KFbxVector4( -0.245220f,  0.639318f, -0.728793f ),
-    KFbxVector4(  0.250978f,  0.855979f,  0.452006f ),
-    KFbxVector4( -0.123547f,  0.982443f, -0.139791f ),
-    KFbxVector4( -0.794825f,  0.030254f, -0.606084f ),
-    KFbxVector4( -0.772905f,  0.547941f,  0.319967f ),
-    KFbxVector4(  0.916347f,  0.369614f, -0.153928f ),
-    KFbxVector4( -0.388203f,  0.105395f,  0.915527f ),
-    KFbxVector4( -0.700468f, -0.709334f,  0.078677f ),
-    KFbxVector4( -0.816193f,  0.390455f,  0.425880f ),
-    KFbxVector4( -0.043007f,  0.769222f, -0.637533f ),
-    KFbxVector4(  0.911444f,  0.113150f,  0.395560f ),
-    KFbxVector4(  0.845801f,  0.156091f, -0.510153f ),
-    KFbxVector4(  0.829801f, -0.029340f,  0.557287f ),
-    KFbxVector4(  0.259529f,  0.416263f,  0.871418f ),
-    KFbxVector4(  0.231128f, -0.845982f,  0.480515f ),
-    KFbxVector4( -0.626203f, -0.646168f,  0.436277f ),
-    KFbxVector4( -0.197047f, -0.065791f,  0.978184f ),
-    KFbxVector4( -0.255692f, -0.637488f, -0.726794f ),
-    KFbxVector4(  0.530662f, -0.844385f, -0.073567f ),
-    KFbxVector4( -0.779887f,  0.617067f, -0.104899f ),
-    KFbxVector4(  0.739908f,  0.113984f,  0.662982f ),
-    KFbxVector4( -0.218801f,  0.930194f, -0.294729f ),
-    KFbxVector4( -0.374231f,  0.818666f,  0.435589f ),
-    KFbxVector4( -0.720250f, -0.028285f,  0.693137f ),
-    KFbxVector4(  0.075389f,  0.415049f,  0.906670f ),
-    KFbxVector4( -0.539724f, -0.106620f,  0.835063f ),
-    KFbxVector4( -0.452612f, -0.754669f, -0.474991f ),
-    KFbxVector4(  0.682822f,  0.581234f, -0.442629f ),
-    KFbxVector4(  0.002435f, -0.618462f, -0.785811f ),
-    KFbxVector4( -0.397631f,  0.110766f, -0.910835f ),
-    KFbxVector4(  0.133935f, -0.985438f,  0.104754f ),
-    KFbxVector4(  0.759098f, -0.608004f,  0.232595f ),
-    KFbxVector4( -0.825239f, -0.256087f,  0.503388f ),
-    KFbxVector4(  0.101693f, -0.565568f,  0.818408f ),
-    KFbxVector4(  0.386377f,  0.793546f, -0.470104f ),
-    KFbxVector4( -0.520516f, -0.840690f,  0.149346f ),
-    KFbxVector4( -0.784549f, -0.479672f,  0.392935f ),
-    KFbxVector4( -0.325322f, -0.927581f, -0.183735f ),
-    KFbxVector4( -0.069294f, -0.428541f,  0.900861f ),
-    KFbxVector4(  0.993354f, -0.115023f, -0.004288f ),
-    KFbxVector4( -0.123896f, -0.700568f,  0.702747f ),
-    KFbxVector4( -0.438031f, -0.120880f, -0.890795f ),
-    KFbxVector4(  0.063314f,  0.813233f,  0.578484f ),
-    KFbxVector4(  0.322045f,  0.889086f, -0.325289f ),
-    KFbxVector4( -0.133521f,  0.875063f, -0.465228f ),
-    KFbxVector4(  0.637155f,  0.564814f,  0.524422f ),
-    KFbxVector4(  0.260092f, -0.669353f,  0.695930f ),
-    KFbxVector4(  0.953195f,  0.040485f, -0.299634f ),
-    KFbxVector4( -0.840665f, -0.076509f,  0.536124f ),
-    KFbxVector4( -0.971350f,  0.202093f,  0.125047f ),
-    KFbxVector4( -0.804307f, -0.396312f, -0.442749f ),
-    KFbxVector4( -0.936746f,  0.069572f,  0.343027f ),
-    KFbxVector4(  0.426545f, -0.465962f,  0.775202f ),
-    KFbxVector4(  0.794542f, -0.227450f,  0.563000f ),
-    KFbxVector4( -0.892172f,  0.091169f, -0.442399f ),
-    KFbxVector4( -0.312654f,  0.541264f,  0.780564f ),
-    KFbxVector4(  0.590603f, -0.735618f, -0.331743f ),
-    KFbxVector4( -0.098040f, -0.986713f,  0.129558f ),
-    KFbxVector4(  0.569646f,  0.283078f, -0.771603f ),
-    KFbxVector4(  0.431051f, -0.407385f, -0.805129f ),
-    KFbxVector4( -0.162087f, -0.938749f, -0.304104f ),
-    KFbxVector4(  0.241533f, -0.359509f,  0.901341f ),
-    KFbxVector4( -0.576191f,  0.614939f,  0.538380f ),
-    KFbxVector4( -0.025110f,  0.085740f,  0.996001f ),
-    KFbxVector4( -0.352693f, -0.198168f,  0.914515f ),
-    KFbxVector4( -0.604577f,  0.700711f,  0.378802f ),
-    KFbxVector4(  0.465024f,  0.409667f,  0.784809f ),
-    KFbxVector4( -0.254684f, -0.030474f, -0.966544f ),
-    KFbxVector4( -0.604789f,  0.791809f,  0.085259f ),
-    KFbxVector4( -0.705147f, -0.399298f,  0.585943f ),
-    KFbxVector4(  0.185691f,  0.017236f, -0.982457f ),
-    KFbxVector4(  0.044588f,  0.973094f,  0.226052f ),
-    KFbxVector4( -0.405463f,  0.642367f,  0.650357f ),
-    KFbxVector4( -0.563959f,  0.599136f, -0.568319f ),
-    KFbxVector4(  0.367162f, -0.072253f, -0.927347f ),
-    KFbxVector4(  0.960429f, -0.213570f, -0.178783f ),
-    KFbxVector4( -0.192629f,  0.906005f,  0.376893f ),
-    KFbxVector4( -0.199718f, -0.359865f, -0.911378f ),
-    KFbxVector4(  0.485072f,  0.121233f, -0.866030f ),
-    KFbxVector4(  0.467163f, -0.874294f,  0.131792f ),
-    KFbxVector4( -0.638953f, -0.716603f,  0.279677f ),
-    KFbxVector4( -0.622710f,  0.047813f, -0.780990f ),
-    KFbxVector4(  0.828724f, -0.054433f, -0.557004f ),
-    KFbxVector4(  0.130241f,  0.991080f,  0.028245f ),
-    KFbxVector4(  0.310995f, -0.950076f, -0.025242f ),
-    KFbxVector4(  0.818118f,  0.275336f,  0.504850f ),
-    KFbxVector4(  0.676328f,  0.387023f,  0.626733f ),
-    KFbxVector4( -0.100433f,  0.495114f, -0.863004f ),
-    KFbxVector4( -0.949609f, -0.240681f, -0.200786f ),
-    KFbxVector4( -0.102610f,  0.261831f, -0.959644f ),
-    KFbxVector4( -0.845732f, -0.493136f,  0.203850f ),
-    KFbxVector4(  0.672617f, -0.738838f,  0.041290f ),
-    KFbxVector4(  0.380465f,  0.875938f,  0.296613f ),
-    KFbxVector4( -0.811223f,  0.262027f, -0.522742f ),
-    KFbxVector4( -0.074423f, -0.775670f, -0.626736f ),
-    KFbxVector4( -0.286499f,  0.755850f, -0.588735f ),
-    KFbxVector4(  0.291182f, -0.276189f, -0.915933f ),
-    KFbxVector4( -0.638117f,  0.199338f,  0.743687f ),
-    KFbxVector4(  0.439922f, -0.864433f, -0.243359f ),
-    KFbxVector4(  0.177649f,  0.206919f,  0.962094f ),
-    KFbxVector4(  0.277107f,  0.948521f,  0.153361f ),
-    KFbxVector4(  0.507629f,  0.661918f, -0.551523f ),
-    KFbxVector4( -0.503110f, -0.579308f, -0.641313f ),
-    KFbxVector4(  0.600522f,  0.736495f, -0.311364f ),
-    KFbxVector4( -0.691096f, -0.715301f, -0.103592f ),
-    KFbxVector4( -0.041083f, -0.858497f,  0.511171f ),
-    KFbxVector4(  0.207773f, -0.480062f, -0.852274f ),
-    KFbxVector4(  0.795719f,  0.464614f,  0.388543f ),
-    KFbxVector4( -0.100433f,  0.495114f, -0.863004f ),
-    KFbxVector4(  0.703249f,  0.065157f, -0.707951f ),
-    KFbxVector4( -0.324171f, -0.941112f,  0.096024f ),
-    KFbxVector4( -0.134933f, -0.940212f,  0.312722f ),
-    KFbxVector4( -0.438240f,  0.752088f, -0.492249f ),
-    KFbxVector4(  0.964762f, -0.198855f,  0.172311f ),
-    KFbxVector4( -0.831799f,  0.196807f,  0.519015f ),
-    KFbxVector4( -0.508008f,  0.819902f,  0.263986f ),
-    KFbxVector4(  0.471075f, -0.001146f,  0.882092f ),
-    KFbxVector4(  0.919512f,  0.246162f, -0.306435f ),
-    KFbxVector4( -0.960050f,  0.279828f, -0.001187f ),
-    KFbxVector4(  0.110232f, -0.847535f, -0.519165f ),
-    KFbxVector4(  0.208229f,  0.697360f,  0.685806f ),
-    KFbxVector4( -0.199680f, -0.560621f,  0.803637f ),
-    KFbxVector4(  0.170135f, -0.679985f, -0.713214f ),
-    KFbxVector4(  0.758371f, -0.494907f,  0.424195f ),
-    KFbxVector4(  0.077734f, -0.755978f,  0.649965f ),
-    KFbxVector4(  0.612831f, -0.672475f,  0.414987f ),
-    KFbxVector4(  0.142776f,  0.836698f, -0.528726f ),
-    KFbxVector4( -0.765185f,  0.635778f,  0.101382f ),
-    KFbxVector4(  0.669873f, -0.419737f,  0.612447f ),
-    KFbxVector4(  0.593549f,  0.194879f,  0.780847f ),
-    KFbxVector4(  0.646930f,  0.752173f,  0.125368f ),
-    KFbxVector4(  0.837721f,  0.545266f, -0.030127f ),
-    KFbxVector4(  0.541505f,  0.768070f,  0.341820f ),
-    KFbxVector4(  0.760679f, -0.365715f, -0.536301f ),
-    KFbxVector4(  0.381516f,  0.640377f,  0.666605f ),
-    KFbxVector4(  0.565794f, -0.072415f, -0.821361f ),
-    KFbxVector4( -0.466072f, -0.401588f,  0.788356f ),
-    KFbxVector4(  0.987146f,  0.096290f,  0.127560f ),
-    KFbxVector4(  0.509709f, -0.688886f, -0.515396f ),
-    KFbxVector4( -0.135132f, -0.988046f, -0.074192f ),
-    KFbxVector4(  0.600499f,  0.476471f, -0.642166f ),
-    KFbxVector4( -0.732326f, -0.275320f, -0.622815f ),
-    KFbxVector4( -0.881141f, -0.470404f,  0.048078f ),
-    KFbxVector4(  0.051548f,  0.601042f,  0.797553f ),
-    KFbxVector4(  0.402027f, -0.763183f,  0.505891f ),
-    KFbxVector4(  0.404233f, -0.208288f,  0.890624f ),
-    KFbxVector4( -0.311793f,  0.343843f,  0.885752f ),
-    KFbxVector4(  0.098132f, -0.937014f,  0.335223f ),
-    KFbxVector4(  0.537158f,  0.830585f, -0.146936f ),
-    KFbxVector4(  0.725277f,  0.298172f, -0.620538f ),
-    KFbxVector4( -0.882025f,  0.342976f, -0.323110f ),
-    KFbxVector4( -0.668829f,  0.424296f, -0.610443f ),
-    KFbxVector4( -0.408835f, -0.476442f, -0.778368f ),
-    KFbxVector4(  0.809472f,  0.397249f, -0.432375f ),
-    KFbxVector4( -0.909184f, -0.205938f, -0.361903f ),
-    KFbxVector4(  0.866930f, -0.347934f, -0.356895f ),
-    KFbxVector4(  0.911660f, -0.141281f, -0.385897f ),
-    KFbxVector4( -0.431404f, -0.844074f, -0.318480f ),
-    KFbxVector4( -0.950593f, -0.073496f,  0.301614f ),
-    KFbxVector4( -0.719716f,  0.626915f, -0.298305f ),
-    KFbxVector4( -0.779887f,  0.617067f, -0.104899f ),
-    KFbxVector4( -0.475899f, -0.542630f,  0.692151f ),
-    KFbxVector4(  0.081952f, -0.157248f, -0.984153f ),
-    KFbxVector4(  0.923990f, -0.381662f, -0.024025f ),
-    KFbxVector4( -0.957998f,  0.120979f, -0.260008f ),
-    KFbxVector4(  0.306601f,  0.227975f, -0.924134f ),
-    KFbxVector4( -0.141244f,  0.989182f,  0.039601f ),
-    KFbxVector4(  0.077097f,  0.186288f, -0.979466f ),
-    KFbxVector4( -0.630407f, -0.259801f,  0.731499f ),
-    KFbxVector4(  0.718150f,  0.637408f,  0.279233f ),
-    KFbxVector4(  0.340946f,  0.110494f,  0.933567f ),
-    KFbxVector4( -0.396671f,  0.503020f, -0.767869f ),
-    KFbxVector4(  0.636943f, -0.245005f,  0.730942f ),
-    KFbxVector4( -0.849605f, -0.518660f, -0.095724f ),
-    KFbxVector4( -0.388203f,  0.105395f,  0.915527f ),
-    KFbxVector4( -0.280671f, -0.776541f, -0.564099f ),
-    KFbxVector4( -0.601680f,  0.215451f, -0.769131f ),
-    KFbxVector4( -0.660112f, -0.632371f, -0.405412f ),
-    KFbxVector4(  0.921096f,  0.284072f,  0.266242f ),
-    KFbxVector4(  0.074850f, -0.300846f,  0.950731f ),
-    KFbxVector4(  0.943952f, -0.067062f,  0.323198f ),
-    KFbxVector4( -0.917838f, -0.254589f,  0.304561f ),
-    KFbxVector4(  0.889843f, -0.409008f,  0.202219f ),
-    KFbxVector4( -0.565849f,  0.753721f, -0.334246f ),
-    KFbxVector4(  0.791460f,  0.555918f, -0.254060f ),
-    KFbxVector4(  0.261936f,  0.703590f, -0.660568f ),
-    KFbxVector4( -0.234406f,  0.952084f,  0.196444f ),
-    KFbxVector4(  0.111205f,  0.979492f, -0.168014f ),
-    KFbxVector4( -0.869844f, -0.109095f, -0.481113f ),
-    KFbxVector4( -0.337728f, -0.269701f, -0.901777f ),
-    KFbxVector4(  0.366793f,  0.408875f, -0.835634f ),
-    KFbxVector4( -0.098749f,  0.261316f,  0.960189f ),
-    KFbxVector4( -0.272379f, -0.847100f,  0.456324f ),
-    KFbxVector4( -0.319506f,  0.287444f, -0.902935f ),
-    KFbxVector4(  0.873383f, -0.294109f,  0.388203f ),
-    KFbxVector4( -0.088950f,  0.710450f,  0.698104f ),
-    KFbxVector4(  0.551238f, -0.786552f,  0.278340f ),
-    KFbxVector4(  0.724436f, -0.663575f, -0.186712f ),
-    KFbxVector4(  0.529741f, -0.606539f,  0.592861f ),
-    KFbxVector4( -0.949743f, -0.282514f,  0.134809f ),
-    KFbxVector4(  0.155047f,  0.419442f, -0.894443f ),
-    KFbxVector4( -0.562653f, -0.329139f, -0.758346f ),
-    KFbxVector4(  0.816407f, -0.576953f,  0.024576f ),
-    KFbxVector4(  0.178550f, -0.950242f, -0.255266f ),
-    KFbxVector4(  0.479571f,  0.706691f,  0.520192f ),
-    KFbxVector4(  0.391687f,  0.559884f, -0.730145f ),
-    KFbxVector4(  0.724872f, -0.205570f, -0.657496f ),
-    KFbxVector4( -0.663196f, -0.517587f, -0.540624f ),
-    KFbxVector4( -0.660054f, -0.122486f, -0.741165f ),
-    KFbxVector4( -0.531989f,  0.374711f, -0.759328f ),
-    KFbxVector4(  0.194979f, -0.059120f,  0.979024f )
-};
+    KFbxNodeAttribute* attr = node->GetNodeAttribute();
 
-bool FBXExporter::load(const char* fbxFile)
+    if (attr && !attr->Is(FBX_TYPE(KFbxSkeleton)))
+    {
+        node->SetNodeAttribute(NULL);
+        attr->Destroy();
+    }
+
+    for (int child = 0; child < node->GetChildCount(); child++)
+    {
+        stripAttributes(node->GetChild(child));
+    }
+}
+
+// With skeletonOnly, only the node hierarchy and the animation stacks are
+// kept: materials, textures, embedded media, blend shapes and skins are not
+// imported, and the imported geometry is dropped.
+bool FBXExporter::load(const char* fbxFile, bool skeletonOnly)
 {
     KFbxImporter*   importer   = KFbxImporter::Create(sdkManager, "");
     KFbxIOSettings* ioSettings = KFbxIOSettings::Create(sdkManager, IOSROOT);
     
-    ioSettings->SetBoolProp(IMP_FBX_MATERIAL,  true);
-    ioSettings->SetBoolProp(IMP_FBX_TEXTURE,   true);
+    ioSettings->SetBoolProp(IMP_FBX_MATERIAL,  !skeletonOnly);
+    ioSettings->SetBoolProp(IMP_FBX_TEXTURE,   !skeletonOnly);
     ioSettings->SetBoolProp(IMP_FBX_ANIMATION, true);
-    ioSettings->SetBoolProp(IMP_FBX_SHAPE,     true);
+    ioSettings->SetBoolProp(IMP_FBX_SHAPE,     !skeletonOnly);
+
+    if (skeletonOnly)
+    {
+        ioSettings->SetBoolProp(IMP_FBX_LINK,                  false);
+        ioSettings->SetBoolProp(IMP_FBX_GOBO,                  false);
+        ioSettings->SetBoolProp(IMP_FBX_CHARACTER,             false);
+        ioSettings->SetBoolProp(IMP_FBX_CONSTRAINT,            false);
+        ioSettings->SetBoolProp(IMP_FBX_EXTRACT_EMBEDDED_DATA, false);
+    }
     
     if (!importer->Initialize(fbxFile, -1, ioSettings))
     {
@@ -415,6 +235,12 @@ bool FBXExporter::load(const char* fbxFile)
     }
 
     importer->Destroy();
+
+    if (skeletonOnly)
+    {
+        stripAttributes(scene->GetRootNode());
+    }
+
     return true;
 }
 
@@ -483,7 +309,7 @@ KFbxSurfaceMaterial* FBXExporter::convertMaterial(const DTSResolver& resolver, c
     return materialFbx;
 } 
 
-void FBXExporter::convertMesh(const DTSShape& shape, const DTSMesh& mesh, KFbxNode* node)
+void FBXExporter::convertMesh(const DTSShape& shape, const DTSMesh& mesh, KFbxNode* node, bool createSkeleton)
 {
     if (mesh.vertsPerFrame == 0)
     {
@@ -522,92 +348,46 @@ void FBXExporter::convertMesh(const DTSShape& shape, const DTSMesh& mesh, KFbxNo
 #endif
     }
     
-    if (mesh.enormals.size() > 0)
-    {
-        for (index = 0; index < mesh.vertsPerFrame; index++)
-        {
-            meshNormals->GetDirectArray().Add(NormalTable[mesh.enormals[index]]);
-        }
-    }
-    else
+    DTSDecodedNormals normals;
+
+    DTSMeshTools::decodeNormals(mesh, mesh.vertsPerFrame, normals);
+
+    for (index = 0; index < mesh.vertsPerFrame; index++)
     {
-        for (index = 0; index < mesh.vertsPerFrame; index++)
-        {
-            KFbxVector4 n(mesh.normals[index].x, mesh.normals[index].y, mesh.normals[index].z);
-            
-            meshNormals->GetDirectArray().Add(n);
-        }
+        meshNormals->GetDirectArray().Add(KFbxVector4(normals.x[index], normals.y[index], normals.z[index]));
     }
     
-    std::vector<DTSPrimitive>::const_iterator primIt, primEnd(mesh.primitives.end());
+    DTSTriangles      triangles;
     std::map<int,int> materialMap;
-    bool              orient;
-    
-    for (primIt = mesh.primitives.begin(); primIt != primEnd; ++primIt)
+    int               rawMatIndex = -1;
+    int               mapMatIndex = -1;
+
+    DTSMeshTools::expandTriangles(mesh, triangles);
+
+    for (index = 0; index < triangles.count(); index++)
     {
-        const DTSPrimitive& primitive(*primIt);
-        int mapMatIndex = -1;
-        int rawMatIndex = primitive.type & 0xffff;
-        
-        std::map<int,int>::const_iterator matIt = materialMap.find(rawMatIndex);
-        
-        if (matIt == materialMap.end())
-        {
-            mapMatIndex = node->AddMaterial(materials[rawMatIndex]);
-            materialMap.insert(std::pair<int,int>(rawMatIndex, mapMatIndex));
-        }
-        else
-        {
-            mapMatIndex = matIt->second;
-        }
-        
-        switch (primitive.type >> 30)
+        if (triangles.materials[index] != rawMatIndex)
         {
-            case 0: // TRIANGLE_LIST:
-                for (index = primitive.firstElement; index < (primitive.firstElement + primitive.numElements); index += 3)
-                {
-                    meshFbx->BeginPolygon(mapMatIndex);
-                    meshFbx->AddPolygon(mesh.indices[index]);
-                    meshFbx->AddPolygon(mesh.indices[index + 1]);
-                    meshFbx->AddPolygon(mesh.indices[index + 2]);
-                    meshFbx->EndPolygon();
-                }
-                break;
-            case 1: // TRIANGLE_STRIP:
-                for (index = primitive.firstElement + 2, orient = false; index < (primitive.firstElement + primitive.numElements); index++, orient = !orient)
-                {  
-                    meshFbx->BeginPolygon(mapMatIndex);
-                    
-                    if (orient)
-                    {
-                        meshFbx->AddPolygon(mesh.indices[index - 0]);
-                        meshFbx->AddPolygon(mesh.indices[index - 1]);
-                        meshFbx->AddPolygon(mesh.indices[index - 2]);
-                    }
-                    else
-                    {
-                        meshFbx->AddPolygon(mesh.indices[index - 0]);
-                        meshFbx->AddPolygon(mesh.indices[index - 2]);
-                        meshFbx->AddPolygon(mesh.indices[index - 1]);
-                    }
-                    
-                    meshFbx->EndPolygon();
-                }
-                break;
-            case 2: // TRIANGLE_FAN:
-                for (index = primitive.firstElement + 2; index < (primitive.firstElement + primitive.numElements); index++)
-                {
-                    meshFbx->BeginPolygon(mapMatIndex);
-                    meshFbx->AddPolygon(mesh.indices[primitive.firstElement]);
-                    meshFbx->AddPolygon(mesh.indices[index - 1]);
-                    meshFbx->AddPolygon(mesh.indices[index - 0]);
-                    meshFbx->EndPolygon();
-                }
-                break;
-            default:
-                assert(false);
-                break;
+            rawMatIndex = triangles.materials[index];
+
+            std::map<int,int>::const_iterator matIt = materialMap.find(rawMatIndex);
+            
+            if (matIt == materialMap.end())
+            {
+                mapMatIndex = node->AddMaterial(materials[rawMatIndex]);
+                materialMap.insert(std::pair<int,int>(rawMatIndex, mapMatIndex));
+            }
+            else
+            {
+                mapMatIndex = matIt->second;
+            }
         }
+
+        meshFbx->BeginPolygon(mapMatIndex);
+        meshFbx->AddPolygon(triangles.indices[index * 3 + 0]);
+        meshFbx->AddPolygon(triangles.indices[index * 3 + 1]);
+        meshFbx->AddPolygon(triangles.indices[index * 3 + 2]);
+        meshFbx->EndPolygon();
     }
     
 #ifdef __DEBUG__
@@ -619,7 +399,10 @@ void FBXExporter::convertMesh(const DTSShape& shape, const DTSMesh& mesh, KFbxNo
     
     if (mesh.type == DTSMesh::T_Skin)
     {
-        convertSkeleton(shape, node, mesh.nodeIndex);
+        if (createSkeleton)
+        {
+            convertSkeleton(shape, node, mesh.nodeIndex);
+        }
 
         KFbxXMatrix meshMatrix;
         
@@ -627,42 +410,153 @@ void FBXExporter::convertMesh(const DTSShape& shape, const DTSMesh& mesh, KFbxNo
         
         KFbxSkin* skin = KFbxSkin::Create(scene, "");
         
-        std::vector<int>::const_iterator           nodeIndexIt,  nodeIndexEnd = mesh.nodeIndex.end();
-        std::vector<Matrix<4, 4> >::const_iterator nodeMatrixIt, nodeMatrixEnd = mesh.nodeTransform.end();
-        std::vector<KFbxCluster*>                  clusters;
+        std::vector<int>::const_iterator nodeIndexIt, nodeIndexEnd = mesh.nodeIndex.end();
+        std::vector<KFbxCluster*>        clusters;
         
-        for (nodeIndexIt = mesh.nodeIndex.begin(), nodeMatrixIt = mesh.nodeTransform.begin(); nodeIndexIt != nodeIndexEnd; ++nodeMatrixIt, ++nodeIndexIt)
+        for (nodeIndexIt = mesh.nodeIndex.begin(); nodeIndexIt != nodeIndexEnd; ++nodeIndexIt)
         {
             int            nodeIndex = *nodeIndexIt;
             const DTSNode& dtsNode    (shape.nodes[nodeIndex]);
             std::string    clusterName(shape.names[dtsNode.name]);
             
             KFbxCluster* cluster = KFbxCluster::Create(sdkManager, clusterName.c_str());
+            KFbxXMatrix  linkMatrix;
+            KFbxVector4  linkTranslation;
+            KFbxVector4  linkRotation;
+
+            // The skeleton hangs below the mesh node, still at identity here,
+            // so the link matrix is the bind pose with the root axis change.
+            convert(bindPose.translation(nodeIndex), linkTranslation, true);
+            convert(bindPose.rotation   (nodeIndex), linkRotation,    true);
+            linkMatrix.SetTRS(linkTranslation, linkRotation, KFbxVector4(1, 1, 1));
             
             cluster->SetLink               (skeletonNodes[nodeIndex]);
             cluster->SetLinkMode           (KFbxCluster::eTOTAL1);
             cluster->SetTransformMatrix    (meshMatrix);
-            cluster->SetTransformLinkMatrix(skeletonNodes[nodeIndex]->EvaluateGlobalTransform());
-
-            // TODO: Maybe in the future try to use the nodeMatrixIt instead of using the FBX provided matrixes.
+            cluster->SetTransformLinkMatrix(linkMatrix);
             
             skin->AddCluster(cluster);
             clusters.push_back(cluster);
         }
         
-        std::vector<int>  ::const_iterator vindexIt (mesh.vindex .begin()), vindexEnd (mesh.vindex .end());
-        std::vector<int>  ::const_iterator vboneIt  (mesh.vbone  .begin()), vboneEnd  (mesh.vbone  .end());
-        std::vector<float>::const_iterator vheightIt(mesh.vweight.begin()), vheightEnd(mesh.vweight.end());
-        
-        for (; vindexIt != vindexEnd; ++vindexIt, ++vboneIt, ++vheightIt)
+        DTSSkinCSR skinWeights;
+        int        bone, numBones;
+
+        skinWeights.build(mesh);
+        numBones = skinWeights.numBones();
+
+        // Weights are widened in parallel into a plain array; the clusters
+        // are only touched from this thread.
+        int                 weight, numWeights = (int)skinWeights.weights.size();
+        std::vector<double> weights(numWeights);
+
+#pragma omp parallel for
+        for (weight = 0; weight < numWeights; weight++)
         {
-            KFbxCluster* cluster = clusters[*vboneIt];
-            int          vertex  = *vindexIt;
-            
-            cluster->AddControlPointIndex(vertex, *vheightIt);
+            weights[weight] = skinWeights.weights[weight];
+        }
+
+        for (bone = 0; bone < numBones; bone++)
+        {
+            int first = skinWeights.offsets[bone];
+            int count = skinWeights.count(bone);
+
+            clusters[bone]->SetControlPointIWCount(count);
+
+            if (count > 0)
+            {
+                memcpy(clusters[bone]->GetControlPointIndices(), &skinWeights.vertices[first], count * sizeof(int));
+                memcpy(clusters[bone]->GetControlPointWeights(), &weights[first],              count * sizeof(double));
+            }
         }
         
         meshFbx->AddDeformer(skin);
+
+        if (options.maxInfluences > 0)
+        {
+            skinStreams.add(node->GetName(), mesh, options.maxInfluences);
+        }
+
+        float bindError = bindPose.checkInverseBind(mesh);
+
+        if (bindError > 1e-3f)
+        {
+            fprintf(stderr, "Warning: %s: default pose differs from the skin bind matrices (%f)\n", node->GetName(), bindError);
+        }
+    }
+}
+
+void FBXExporter::convertMeshNode(const DTSShape& shape, const DTSMesh& mesh, KFbxNode* node)
+{
+    std::vector<DTSMesh> parts;
+    DTSPaletteStats      stats;
+
+    exportedMeshes++;
+
+    if (options.instance && mesh.type != DTSMesh::T_Skin && mesh.vertsPerFrame > 0)
+    {
+        size_t   meshIndex = &mesh - &shape.meshes[0];
+        uint64_t hash      = meshIndex < shape.meshHashes.size() ? shape.meshHashes[meshIndex] : DTSMeshTools::contentHash(mesh);
+
+        std::vector<FBXInstance>& candidates(instances[hash]);
+
+        for (size_t candidate = 0; candidate < candidates.size(); candidate++)
+        {
+            const FBXInstance& instance(candidates[candidate]);
+
+            if (DTSMeshTools::sameContent(*instance.mesh, mesh))
+            {
+                // Same attribute, and the same material slots for its indices.
+                for (int material = 0; material < instance.node->GetMaterialCount(); material++)
+                {
+                    node->AddMaterial(instance.node->GetMaterial(material));
+                }
+
+                node->SetNodeAttribute(instance.node->GetNodeAttribute());
+                node->SetShadingMode(KFbxNode::eTEXTURE_SHADING);
+                instancedMeshes++;
+                return;
+            }
+        }
+
+        FBXInstance instance;
+
+        instance.mesh = &mesh;
+        instance.node = node;
+        candidates.push_back(instance);
+
+        convertMesh(shape, mesh, node);
+        return;
+    }
+
+    if (options.paletteSize <= 0 || mesh.type != DTSMesh::T_Skin || (int)mesh.nodeIndex.size() <= options.paletteSize ||
+        !DTSSkinning::splitPalette(mesh, options.paletteSize, parts, stats))
+    {
+        convertMesh(shape, mesh, node);
+        return;
+    }
+
+    // One skeleton for all the parts, each part skinned to a subset of it.
+    convertSkeleton(shape, node, mesh.nodeIndex);
+
+    for (size_t part = 0; part < parts.size(); part++)
+    {
+        char partName[256];
+
+        snprintf(partName, sizeof(partName), "%s_part%i", node->GetName(), (int)part);
+
+        KFbxNode* partNode = KFbxNode::Create(sdkManager, partName);
+
+        node->AddChild(partNode);
+        convertMesh(shape, parts[part], partNode, false);
+    }
+
+    printf("%s: %i bones split into %i meshes, %i draw calls instead of %i, %i of %i vertices duplicated\n",
+           node->GetName(), (int)mesh.nodeIndex.size(), stats.parts, stats.drawCalls, stats.sourceDrawCalls, stats.duplicatedVertices, stats.vertices);
+
+    if (stats.oversizedTriangles > 0)
+    {
+        fprintf(stderr, "Warning: %s: %i triangles need more than %i bones\n", node->GetName(), stats.oversizedTriangles, options.paletteSize);
     }
 }
 
@@ -673,18 +567,8 @@ void FBXExporter::convertNodePositionAndRotation(const DTSShape& shape, int node
         KFbxVector4 translation;
         KFbxVector4 rotation;
     
-        convert(shape.nodeDefTranslations[nodeIndex], translation);
-        convert(shape.nodeDefRotations   [nodeIndex], rotation);
-        
-        if (invertYZ)
-        {
-            KFbxXMatrix mat;
-            
-            mat.SetTRS(translation, rotation, KFbxVector4(1, 1, 1));
-            mat = (*AxisRotation) * mat;
-            translation = mat.GetT();
-            rotation    = mat.GetR();
-        }
+        convert(shape.nodeDefTranslations[nodeIndex], translation, invertYZ);
+        convert(shape.nodeDefRotations   [nodeIndex], rotation,    invertYZ);
 
         node->LclTranslation.Set(translation);
         node->LclRotation   .Set(rotation);
@@ -695,25 +579,77 @@ bool FBXExporter::convertObject(const DTSShape& shape, const DTSSubshape& subsha
 {
     int meshIndex;
     
-    for (meshIndex = object.firstMesh; meshIndex < (object.firstMesh + object.numMeshes); meshIndex++)
+    std::string nodeName;
+    
+    if (object.name != -1)
+    {
+        nodeName = shape.names[object.name];
+    }
+
+    if (strncasecmp(nodeName.c_str(), "col", 3) == 0)
+    {
+        // Skip collisions
+        return true;
+    }
+
+    if (!mergedObjects.empty() && mergedObjects[&object - &shape.objects[0]])
+    {
+        // Exported by convertMerged
+        return true;
+    }
+
+    std::vector<DTSLodLevel> lods;
+
+    shape.objectLods(object, options.screenHeight, lods);
+
+    if (lods.size() > 1)
     {
-        std::string nodeName;
+        // One LOD group per object, children ordered from the most detailed,
+        // the thresholds being the screen size percentages between them.
+        KFbxNode*     groupNode = KFbxNode::Create(sdkManager, nodeName.c_str());
+        KFbxLodGroup* lodGroup  = KFbxLodGroup::Create(sdkManager, nodeName.c_str());
         
-        if (object.name != -1)
+        lodGroup->ThresholdsUsedAsPercentage.Set(true);
+        groupNode->SetNodeAttribute(lodGroup);
+        parentNode->AddChild(groupNode);
+
+        for (size_t lodIndex = 0; lodIndex < lods.size(); lodIndex++)
         {
-            nodeName = shape.names[object.name];
+            char lodName[256];
+
+            snprintf(lodName, sizeof(lodName), "%s_LOD%i", nodeName.c_str(), (int)lodIndex);
+
+            KFbxNode* node = KFbxNode::Create(sdkManager, lodName);
+
+            groupNode->AddChild(node);
+
+            if (lods[lodIndex].mesh != -1)
+            {
+                convertMeshNode(shape, shape.meshes[lods[lodIndex].mesh], node);
+            }
+
+            if (lodIndex > 0)
+            {
+                lodGroup->AddThreshold(lods[lodIndex - 1].coverage * 100.0);
+            }
         }
 
-        if (strncasecmp(nodeName.c_str(), "col", 3) == 0)
+        convertNodePositionAndRotation(shape, object.node, groupNode);
+        return true;
+    }
+    
+    for (meshIndex = object.firstMesh; meshIndex < (object.firstMesh + object.numMeshes); meshIndex++)
+    {
+        if (!shape.meshLoaded[meshIndex])
         {
-            // Skip collisions
+            // Not drawn by any of the exported detail levels
             continue;
         }
 
         KFbxNode* node = KFbxNode::Create(sdkManager, nodeName.c_str());
 
         parentNode->AddChild(node);
-        convertMesh(shape, shape.meshes[meshIndex], node);
+        convertMeshNode(shape, shape.meshes[meshIndex], node);
         convertNodePositionAndRotation(shape, object.node, node);
     }
     
@@ -728,10 +664,128 @@ bool FBXExporter::convertSubshape(const DTSShape& shape, const DTSSubshape& subs
     {
         convertObject(shape, subshape, shape.objects[objectIndex], parentNode);
     }
+
+    if (!mergedObjects.empty())
+    {
+        convertMerged(shape, (int)(&subshape - &shape.subshapes[0]), parentNode);
+    }
     
     return true;
 }
 
+void FBXExporter::convertMerged(const DTSShape& shape, int subshapeIndex, KFbxNode* parentNode)
+{
+    std::vector<DTSLodLevel> lods;
+
+    // Detail levels of the subshape, from the most detailed.
+    for (int level = 0; level < (int)shape.detailLevels.size(); level++)
+    {
+        const DTSDetailLevel& detail(shape.detailLevels[level]);
+
+        if (detail.subshape == subshapeIndex && detail.size >= 0)
+        {
+            DTSLodLevel lod;
+
+            lod.detailLevel = level;
+            lod.mesh        = -1;
+            lod.size        = detail.size;
+            lod.coverage    = detail.size / options.screenHeight;
+
+            size_t position = 0;
+
+            while (position < lods.size() && lods[position].size >= lod.size)
+            {
+                position++;
+            }
+
+            lods.insert(lods.begin() + position, lod);
+        }
+    }
+
+    KFbxLodGroup* lodGroup  = NULL;
+    KFbxNode*     groupNode = NULL;
+
+    for (size_t lodIndex = 0; lodIndex < lods.size(); lodIndex++)
+    {
+        std::vector<DTSMergedMesh> merged;
+
+        DTSMeshMerger::merge(shape, lods[lodIndex].detailLevel, mergedObjects, options.mergeByNode, merged);
+
+        if (merged.empty())
+        {
+            continue;
+        }
+
+        KFbxNode* levelNode = parentNode;
+
+        if (lods.size() > 1)
+        {
+            char lodName[64];
+
+            if (groupNode == NULL)
+            {
+                groupNode = KFbxNode::Create(sdkManager, "Merged");
+                lodGroup  = KFbxLodGroup::Create(sdkManager, "Merged");
+
+                lodGroup->ThresholdsUsedAsPercentage.Set(true);
+                groupNode->SetNodeAttribute(lodGroup);
+                parentNode->AddChild(groupNode);
+            }
+            else
+            {
+                lodGroup->AddThreshold(lods[lodIndex - 1].coverage * 100.0);
+            }
+
+            snprintf(lodName, sizeof(lodName), "Merged_LOD%i", (int)lodIndex);
+
+            levelNode = KFbxNode::Create(sdkManager, lodName);
+            groupNode->AddChild(levelNode);
+        }
+
+        for (size_t index = 0; index < merged.size(); index++)
+        {
+            const DTSMergedMesh& mergedMesh(merged[index]);
+
+            std::string name("Merged_");
+
+            name += shape.materials[mergedMesh.material].name;
+
+            if (mergedMesh.node != -1)
+            {
+                name += "_" + shape.nodeNameAtIndex(mergedMesh.node);
+            }
+
+            KFbxNode* node = KFbxNode::Create(sdkManager, name.c_str());
+
+            levelNode->AddChild(node);
+            convertMesh(shape, mergedMesh.mesh, node);
+
+            if (mergedMesh.node != -1)
+            {
+                convertNodePositionAndRotation(shape, mergedMesh.node, node);
+            }
+
+            // Source objects and their index and vertex ranges, as object:first:count:firstVertex:vertexCount.
+            std::string submeshes;
+
+            for (size_t submesh = 0; submesh < mergedMesh.submeshes.size(); submesh++)
+            {
+                const DTSSubmesh& range(mergedMesh.submeshes[submesh]);
+                char              text[512];
+
+                snprintf(text, sizeof(text), "%s%s:%i:%i:%i:%i", submesh ? "," : "", shape.objectNameAtIndex(range.object).c_str(),
+                         range.firstElement, range.numElements, range.firstVertex, range.numVertices);
+                submeshes += text;
+            }
+
+            KFbxProperty property = KFbxProperty::Create(node, DTString, "DTSSubmeshes");
+
+            property.ModifyFlag(KFbxUserProperty::eUSER, true);
+            property.Set(KString(submeshes.c_str()));
+        }
+    }
+}
+
 bool FBXExporter::convertSkeleton(const DTSShape& shape, KFbxNode* parentNode, const std::vector<int>& nodeIndexes)
 {
     KFbxNode* rootSkeletonNode = KFbxNode::Create(scene, "Skeleton");
@@ -840,230 +894,691 @@ public:
     }
 };
 
-void FBXExporter::convertAnimation(const DTSShape& shape, const DTSShape& file, const DTSSequence& sequence)
+static void addKeys(KFbxAnimCurve* curve, const float* values, int count, double timePerFrame, int interpolation)
 {
-    scene->RemoveAnimStack(sequence.name.c_str());
+    KTime time;
+    int   frame, keyIndex;
 
-    KFbxAnimStack*             animStack = KFbxAnimStack::Create(scene, sequence.name.c_str());
-    KFbxAnimLayer*             animLayer = KFbxAnimLayer::Create(scene, "Base Layer");
-    std::vector<AnimatedNode*> animCurves;
+    curve->KeyModifyBegin();
 
-    // Start by initializing all the animated node informations.
+    for (frame = 0; frame < count; frame++)
     {
-        std::vector<KFbxNode*>::const_iterator it, end = skeletonNodes.end();
+        time.SetSecondDouble(timePerFrame * frame);
 
-        for (it = skeletonNodes.begin(); it != end; ++it)
-        {
-            if (*it)
-            {
-                animCurves.push_back(new AnimatedNode(animLayer, *it));
-            }
-            else
-            {
-                animCurves.push_back(NULL);
-            }
-        }
+        keyIndex = curve->KeyAdd(time);
+        curve->KeySetValue(keyIndex, values[frame]);
+        curve->KeySetInterpolation(keyIndex, interpolation);
     }
-    
-    int frame, nodeIndex, keyIndex, nodeIndexInBaseShape;
-
-    std::vector<Point>     ::const_iterator translation = file.nodeTranslations.begin();
-    std::vector<Quaternion>::const_iterator rotation    = file.nodeRotations.begin();
-//    std::vector<Point>     ::const_iterator scale       = file.nodeScalesAligned.begin();
+}
 
-    
-    KTime          time;
-    double         timePerFrame = sequence.duration / double(sequence.numKeyFrames);
-    KFbxAnimCurve* curve;
-    bool           invertYZ = true;
-
-    time.SetSecondDouble(0);
-    animStack->LocalStart.Set(time);
-    animStack->ReferenceStart.Set(time);
-    time.SetSecondDouble(sequence.duration);
-    animStack->LocalStop.Set(time);
-    animStack->ReferenceStop.Set(time);
-    
-    std::vector<bool>::const_iterator matPosition;
-    std::vector<bool>::const_iterator matRotation;
+static int addKeys(KFbxAnimCurve* curve, const float* values, const std::vector<int>& frames, double timePerFrame)
+{
+    KTime time;
+    int   keyIndex;
 
-    nodeIndex   = 0;
-    matPosition = sequence.matters.translation.begin();
-    matRotation = sequence.matters.rotation   .begin();
+    curve->KeyModifyBegin();
 
-    for (; matPosition != sequence.matters.translation.end(); ++matPosition, ++matRotation, ++nodeIndex)
+    for (size_t frame = 0; frame < frames.size(); frame++)
     {
-        if (!(*matPosition) && !(*matRotation))
-        {
-            continue;
-        }
-        
-        invertYZ = false;
+        time.SetSecondDouble(timePerFrame * frames[frame]);
 
-        if (&shape == &file)
-        {
-            nodeIndexInBaseShape = nodeIndex;
-        }
-        else
-        {
-            nodeIndexInBaseShape = shape.findNode(file.names[nodeIndex].c_str());
-        }
+        keyIndex = curve->KeyAdd(time);
+        curve->KeySetValue(keyIndex, values[frames[frame]]);
+        curve->KeySetInterpolation(keyIndex, KFbxAnimCurveDef::eINTERPOLATION_LINEAR);
+    }
 
-        if (skeletonNodes[nodeIndex])
-        {
-            KFbxNodeAttribute* attr = skeletonNodes[nodeIndex]->GetNodeAttribute();
-            
-            if (attr)
-            {
-                if (attr->Is(FBX_TYPE(KFbxSkeleton)))
-                {
-                    KFbxSkeleton* attrSkeleton = (KFbxSkeleton*)attr;
-                    
-                    invertYZ = (attrSkeleton->GetSkeletonType() == KFbxSkeleton::eROOT);
-                }
-            }
-        }
+    return (int)frames.size();
+}
 
-        for (frame = 0; frame < sequence.numKeyFrames; frame++)
-        {
-            time.SetSecondDouble(timePerFrame * frame);
+// Keys of one animated node in one sequence, baked into plain arrays
+// without touching the SDK before being written to the curves.
+struct FBXNodeKeys
+{
+    const DTSSequence*     sequence;
+    const DTSResampleGrid* grid;        // Sampled poses, NULL to keep the keys of the sequence
+    AnimatedNode*          curves;
+
+    int    numKeys;
+    double timePerFrame;
+
+    int  node;
+    int  nodeInBaseShape;
+    int  translationIndex;  // First key in file.nodeTranslations, or -1 for the default
+    int  rotationIndex;     // First key in file.nodeRotations, or -1 for the default
+    bool invertYZ;
+    bool updateTranslation;
+    bool updateRotation;
+
+    // tx, ty, tz, rx, ry, rz, numKeys each, and their kept frames when reducing.
+    std::vector<float> keys;
+    std::vector<int>   frames[6];
+};
 
-            if ((skeletonNodes[nodeIndex] != NULL) &&
-                (animCurves   [nodeIndex] != NULL))
-            {
-                KFbxVector4 fbxTranslation;
-                KFbxVector4 fbxRotation;
-                
-                if (*matPosition)
-                {
-                    convert(*translation, fbxTranslation, invertYZ && !(*matRotation));
-                }
-                else
-                {
-                    convert(shape.nodeDefTranslations[nodeIndexInBaseShape], fbxTranslation, invertYZ && !(*matRotation));
-                }
+struct FBXSequenceStack
+{
+    KFbxAnimStack*             animStack;
+    KFbxAnimLayer*             animLayer;
+    std::vector<AnimatedNode*> animCurves;
+    DTSResampleGrid            grid;
+};
+
+// The stacks and tasks of one shape or sequence file, carried from stage
+// one to stage three.
+struct FBXAnimationBatch
+{
+    const DTSShape*               file;
+    std::vector<int>              shapeNodes;
+    std::vector<FBXSequenceStack> stacks;
+    std::vector<FBXNodeKeys>      tasks;
+};
+
+static void bakeNodeKeys(const DTSShape& shape, const DTSShape& file, const DTSExportOptions& options, FBXNodeKeys& task)
+{
+    int numKeyFrames = task.numKeys;
+    int frame;
+
+    std::vector<Point>      decodedTranslations;
+    std::vector<Quaternion> decodedRotations;
+
+    task.keys.resize(6 * numKeyFrames);
+
+    float* tx = &task.keys[0] + numKeyFrames * 0;
+    float* ty = &task.keys[0] + numKeyFrames * 1;
+    float* tz = &task.keys[0] + numKeyFrames * 2;
+    float* rx = &task.keys[0] + numKeyFrames * 3;
+    float* ry = &task.keys[0] + numKeyFrames * 4;
+    float* rz = &task.keys[0] + numKeyFrames * 5;
+
+    if (task.updateTranslation)
+    {
+        // Roots only get their translations swapped along with an animated rotation.
+        bool swapTranslation = task.invertYZ && (task.rotationIndex >= 0);
+
+        const Point* points;
+        int          stride = 0;
+
+        // Stage one drops tasks needing the pose of a node the shape lacks.
+        if (task.grid)
+        {
+            points = &task.grid->translations[task.nodeInBaseShape * numKeyFrames];
+            stride = 1;
+        }
+        else if (task.translationIndex >= 0)
+        {
+            decodedTranslations.resize(task.sequence->numKeyFrames);
+            file.decodeTranslations(task.translationIndex, task.sequence->numKeyFrames, &decodedTranslations[0]);
+            points = &decodedTranslations[0];
+            stride = 1;
+        }
+        else
+        {
+            points = &shape.nodeDefTranslations[task.nodeInBaseShape];
+        }
+
+        for (frame = 0; frame < numKeyFrames; frame++)
+        {
+            Point p(points[frame * stride]);
+
+            if (swapTranslation)
+            {
+                DTSMath::swapAxis(p);
+            }
+
+            tx[frame] = p.x * 100.0f;
+            ty[frame] = p.y * 100.0f;
+            tz[frame] = p.z * 100.0f;
+        }
+
+        if (options.translationTolerance >= 0)
+        {
+            // Values are in centimeters by now.
+            float tolerance = options.translationTolerance * 100.0f;
+
+            DTSKeyReducer::reduce(tx, numKeyFrames, tolerance, task.frames[0]);
+            DTSKeyReducer::reduce(ty, numKeyFrames, tolerance, task.frames[1]);
+            DTSKeyReducer::reduce(tz, numKeyFrames, tolerance, task.frames[2]);
+        }
+    }
+
+    if (task.updateRotation)
+    {
+        if (task.grid)
+        {
+            DTSMath::quaternionsToEuler(&task.grid->rotations[task.nodeInBaseShape * numKeyFrames], numKeyFrames, task.invertYZ, rx, ry, rz);
+        }
+        else if (task.rotationIndex >= 0)
+        {
+            decodedRotations.resize(task.sequence->numKeyFrames);
+            file.decodeRotations(task.rotationIndex, task.sequence->numKeyFrames, &decodedRotations[0]);
+
+            DTSMath::quaternionsToEuler(&decodedRotations[0], numKeyFrames, task.invertYZ, rx, ry, rz);
+        }
+        else
+        {
+            DTSMath::quaternionToEuler(shape.nodeDefRotations[task.nodeInBaseShape], task.invertYZ, rx[0], ry[0], rz[0]);
+
+            for (frame = 1; frame < numKeyFrames; frame++)
+            {
+                rx[frame] = rx[0];
+                ry[frame] = ry[0];
+                rz[frame] = rz[0];
+            }
+        }
+
+        if (options.rotationTolerance >= 0)
+        {
+            DTSKeyReducer::unwrapAngles(rx, numKeyFrames);
+            DTSKeyReducer::unwrapAngles(ry, numKeyFrames);
+            DTSKeyReducer::unwrapAngles(rz, numKeyFrames);
+
+            DTSKeyReducer::reduce(rx, numKeyFrames, options.rotationTolerance, task.frames[3]);
+            DTSKeyReducer::reduce(ry, numKeyFrames, options.rotationTolerance, task.frames[4]);
+            DTSKeyReducer::reduce(rz, numKeyFrames, options.rotationTolerance, task.frames[5]);
+        }
+    }
+}
+
+void FBXExporter::commitNodeKeys(const FBXNodeKeys& task)
+{
+    int    numKeyFrames = task.numKeys;
+    double timePerFrame = task.timePerFrame;
+
+    KFbxAnimCurve* curves[6];
+    int            channel, first, last;
+
+    first = task.updateTranslation ? 0 : 3;
+    last  = task.updateRotation    ? 6 : 3;
+
+    if (first == last)
+    {
+        return;
+    }
+
+    curves[0] = task.curves->tx();
+    curves[1] = task.curves->ty();
+    curves[2] = task.curves->tz();
+    curves[3] = task.curves->rx();
+    curves[4] = task.curves->ry();
+    curves[5] = task.curves->rz();
+
+    for (channel = first; channel < last; channel++)
+    {
+        const float* values        = &task.keys[0] + numKeyFrames * channel;
+        bool         reduce        = (channel < 3) ? (options.translationTolerance >= 0) : (options.rotationTolerance >= 0);
+        int          interpolation = (channel < 3) ? KFbxAnimCurveDef::eINTERPOLATION_CUBIC : KFbxAnimCurveDef::eINTERPOLATION_CONSTANT;
+
+        if (reduce)
+        {
+            writtenKeys += addKeys(curves[channel], values, task.frames[channel], timePerFrame);
+        }
+        else
+        {
+            addKeys(curves[channel], values, numKeyFrames, timePerFrame, interpolation);
+            writtenKeys += numKeyFrames;
+        }
+
+        sampledKeys += numKeyFrames;
+    }
+}
+
+static void hashBytes(uint64_t& hash, const void* data, size_t size)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+}
+
+// 64-bit FNV-1a hash of everything the anim stack of a sequence is built
+// from: its timing, the names, keys, shape nodes and default transforms of
+// its animated nodes, and the options changing how keys are written.
+static uint64_t sequenceHash(const DTSShape& shape, const DTSShape& file, const std::vector<int>& shapeNodes,
+                             const DTSSequence& sequence, const DTSExportOptions& options)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    int      node, numNodes = (int)sequence.matters.rotation.size();
+
+    hashBytes(hash, &sequence.numKeyFrames,         sizeof(int));
+    hashBytes(hash, &sequence.duration,             sizeof(float));
+    hashBytes(hash, &options.fps,                   sizeof(float));
+    hashBytes(hash, &options.translationTolerance,  sizeof(float));
+    hashBytes(hash, &options.rotationTolerance,     sizeof(float));
+
+    std::vector<Quaternion> rotations   (sequence.numKeyFrames);
+    std::vector<Point>      translations(sequence.numKeyFrames);
+
+    for (node = 0; node < numNodes; node++)
+    {
+        int rotationKey    = sequence.rotationKey   (node, 0);
+        int translationKey = sequence.translationKey(node, 0);
+
+        if (rotationKey < 0 && translationKey < 0)
+        {
+            continue;
+        }
+
+        // Sequence files only list node names, shapes have full nodes.
+        std::string name(file.nodes.empty() ? file.names[node] : file.nodeNameAtIndex(node));
+
+        hashBytes(hash, name.c_str(), name.size() + 1);
+
+        // Channels without keys are filled from the shape's default pose.
+        int shapeNode = (node < (int)shapeNodes.size()) ? shapeNodes[node] : -1;
+
+        hashBytes(hash, &shapeNode, sizeof(int));
+
+        if (shapeNode >= 0 && shapeNode < (int)shape.nodeDefRotations.size() && shapeNode < (int)shape.nodeDefTranslations.size())
+        {
+            hashBytes(hash, &shape.nodeDefRotations   [shapeNode], sizeof(Quaternion));
+            hashBytes(hash, &shape.nodeDefTranslations[shapeNode], sizeof(Point));
+        }
+
+        if (rotationKey >= 0 && rotationKey + sequence.numKeyFrames <= (int)file.nodeRotations.size() && sequence.numKeyFrames > 0)
+        {
+            file.decodeRotations(rotationKey, sequence.numKeyFrames, &rotations[0]);
+            hashBytes(hash, "r", 1);
+            hashBytes(hash, &rotations[0], rotations.size() * sizeof(Quaternion));
+        }
+
+        if (translationKey >= 0 && translationKey + sequence.numKeyFrames <= (int)file.nodeTranslations.size() && sequence.numKeyFrames > 0)
+        {
+            file.decodeTranslations(translationKey, sequence.numKeyFrames, &translations[0]);
+            hashBytes(hash, "t", 1);
+            hashBytes(hash, &translations[0], translations.size() * sizeof(Point));
+        }
+    }
+
+    return hash;
+}
+
+KFbxAnimStack* FBXExporter::findAnimStack(const char* name)
+{
+    int index, count = scene->GetSrcObjectCount(FBX_TYPE(KFbxAnimStack));
+
+    for (index = 0; index < count; index++)
+    {
+        KFbxAnimStack* animStack = KFbxCast<KFbxAnimStack>(scene->GetSrcObject(FBX_TYPE(KFbxAnimStack), index));
+
+        if (animStack && strcmp(animStack->GetName(), name) == 0)
+        {
+            return animStack;
+        }
+    }
+
+    return NULL;
+}
+
+// Stage two, on OpenMP worker threads: resample the sequences, then decode
+// and convert the keys of every task of every batch. No SDK calls here.
+static void bakeAnimations(const DTSShape& shape, const DTSExportOptions& options, const std::vector<FBXAnimationBatch*>& batches)
+{
+    std::vector<std::pair<FBXAnimationBatch*, int> > stacks, tasks;
+    int                                              index, count;
+
+    for (size_t batch = 0; batch < batches.size(); batch++)
+    {
+        for (index = 0; index < (int)batches[batch]->stacks.size(); index++)
+        {
+            if (batches[batch]->stacks[index].animStack && options.fps > 0)
+            {
+                stacks.push_back(std::make_pair(batches[batch], index));
+            }
+        }
+
+        for (index = 0; index < (int)batches[batch]->tasks.size(); index++)
+        {
+            tasks.push_back(std::make_pair(batches[batch], index));
+        }
+    }
+
+    count = (int)stacks.size();
+
+#pragma omp parallel for schedule(dynamic)
+    for (index = 0; index < count; index++)
+    {
+        FBXAnimationBatch& batch(*stacks[index].first);
+        int                sequence = stacks[index].second;
+
+        batch.stacks[sequence].grid.sample(shape, *batch.file, batch.shapeNodes, batch.file->sequences[sequence]);
+    }
 
-                if (*matRotation)
+    count = (int)tasks.size();
+
+#pragma omp parallel for schedule(dynamic)
+    for (index = 0; index < count; index++)
+    {
+        FBXAnimationBatch& batch(*tasks[index].first);
+
+        bakeNodeKeys(shape, *batch.file, options, batch.tasks[tasks[index].second]);
+    }
+}
+
+// Converts every sequence of file, or only the given one. Stacks of the
+// same name are replaced, unless they were built from identical keys.
+void FBXExporter::convertAnimations(const DTSShape& shape, const DTSShape& file, int sequenceIndex)
+{
+    FBXAnimationBatch batch;
+
+    prepareAnimations(shape, file, sequenceIndex, batch);
+    bakeAnimations(shape, options, std::vector<FBXAnimationBatch*>(1, &batch));
+    commitAnimations(batch);
+}
+
+// Stage one, on the SDK thread: create the stacks and curves, and list the
+// (sequence, node) pairs to bake. The batch must not be copied afterwards,
+// the tasks point into its stacks.
+void FBXExporter::prepareAnimations(const DTSShape& shape, const DTSShape& file, int sequenceIndex, FBXAnimationBatch& batch)
+{
+    std::vector<FBXSequenceStack>& stacks(batch.stacks);
+    std::vector<FBXNodeKeys>&      tasks (batch.tasks);
+    std::vector<int>&              shapeNodes(batch.shapeNodes);
+
+    batch.file = &file;
+    stacks.resize(file.sequences.size());
+    tasks.clear();
+
+    nodeMap.match(shape, file, shapeNodes);
+
+    std::vector<DTSSequence>::const_iterator seqIt, seqEnd(file.sequences.end());
+    int                                      seqIndex;
+
+    for (seqIt = file.sequences.begin(), seqIndex = 0; seqIt != seqEnd; ++seqIt, ++seqIndex)
+    {
+        const DTSSequence& sequence(*seqIt);
+        FBXSequenceStack&  stack(stacks[seqIndex]);
+
+        stack.animStack = NULL;
+
+        if (sequenceIndex >= 0 && seqIndex != sequenceIndex)
+        {
+            continue;
+        }
+
+        char hash[32];
+
+        snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)sequenceHash(shape, file, shapeNodes, sequence, options));
+
+        KFbxAnimStack* existing = findAnimStack(sequence.name.c_str());
+
+        if (existing)
+        {
+            KFbxProperty property = existing->FindProperty("DTSSequenceHash");
+
+            if (property.IsValid() && strcmp(KFbxGet<KString>(property).Buffer(), hash) == 0)
+            {
+                unchangedStacks++;
+                continue;
+            }
+
+            scene->RemoveAnimStack(sequence.name.c_str());
+            replacedStacks++;
+        }
+        else
+        {
+            addedStacks++;
+        }
+
+        stack.animStack = KFbxAnimStack::Create(scene, sequence.name.c_str());
+
+        KFbxProperty hashProperty = KFbxProperty::Create(stack.animStack, DTString, "DTSSequenceHash");
+
+        hashProperty.ModifyFlag(KFbxUserProperty::eUSER, true);
+        hashProperty.Set(KString(hash));
+
+        stack.animLayer = KFbxAnimLayer::Create(scene, "Base Layer");
+
+        KTime time;
+
+        time.SetSecondDouble(0);
+        stack.animStack->LocalStart.Set(time);
+        stack.animStack->ReferenceStart.Set(time);
+        time.SetSecondDouble(sequence.duration);
+        stack.animStack->LocalStop.Set(time);
+        stack.animStack->ReferenceStop.Set(time);
+
+        if (options.fps > 0)
+        {
+            stack.grid.build(sequence, options.fps);
+        }
+
+        {
+            std::vector<KFbxNode*>::const_iterator it, end = skeletonNodes.end();
+
+            for (it = skeletonNodes.begin(); it != end; ++it)
+            {
+                if (*it)
                 {
-                    convert(*rotation, fbxRotation);
+                    stack.animCurves.push_back(new AnimatedNode(stack.animLayer, *it));
                 }
                 else
                 {
-                    convert(shape.nodeDefRotations[nodeIndexInBaseShape], fbxRotation);
+                    stack.animCurves.push_back(NULL);
                 }
+            }
+        }
 
-                bool updateTranslation = *matPosition || invertYZ;
-                bool updateRotation    = *matRotation || invertYZ;
+        int nodeIndex;
+        int numNodes     = std::min((int)sequence.matters.translation.size(), (int)shapeNodes.size());
+        int numKeyFrames = sequence.numKeyFrames;
 
-                if (invertYZ)
-                {
-                    KFbxXMatrix mat;
+        for (nodeIndex = 0; nodeIndex < numNodes; nodeIndex++)
+        {
+            int translationIndex = sequence.translationKey(nodeIndex, 0);
+            int rotationIndex    = sequence.rotationKey   (nodeIndex, 0);
 
-                    mat.SetTRS(fbxTranslation, fbxRotation, KFbxVector4(1, 1, 1, 1));
-                    mat = (*AxisRotation) * mat;
+            if ((translationIndex < 0) && (rotationIndex < 0))
+            {
+                continue;
+            }
 
-                    fbxTranslation = mat.GetT();
-                    fbxRotation    = mat.GetR();
-                }
+            if ((translationIndex >= 0 && translationIndex + numKeyFrames > (int)file.nodeTranslations.size()) ||
+                (rotationIndex    >= 0 && rotationIndex    + numKeyFrames > (int)file.nodeRotations   .size()))
+            {
+                fprintf(stderr, "Warning: sequence %s has no keys for node %i\n", sequence.name.c_str(), nodeIndex);
+                continue;
+            }
+
+            bool invertYZ = false;
 
-                if (frame == 0)
+            if (skeletonNodes[nodeIndex])
+            {
+                KFbxNodeAttribute* attr = skeletonNodes[nodeIndex]->GetNodeAttribute();
+
+                if (attr)
                 {
-                    if (updateTranslation)
+                    if (attr->Is(FBX_TYPE(KFbxSkeleton)))
                     {
-                        animCurves[nodeIndex]->tx()->KeyModifyBegin();
-                        animCurves[nodeIndex]->ty()->KeyModifyBegin();
-                        animCurves[nodeIndex]->tz()->KeyModifyBegin();
-                    }
+                        KFbxSkeleton* attrSkeleton = (KFbxSkeleton*)attr;
 
-                    if (updateRotation)
-                    {
-                        animCurves[nodeIndex]->rx()->KeyModifyBegin();
-                        animCurves[nodeIndex]->ry()->KeyModifyBegin();
-                        animCurves[nodeIndex]->rz()->KeyModifyBegin();
+                        invertYZ = (attrSkeleton->GetSkeletonType() == KFbxSkeleton::eROOT);
                     }
                 }
+            }
 
-                if (updateTranslation)
-                {
-                    curve    = animCurves[nodeIndex]->tx();
-                    keyIndex = curve->KeyAdd(time);
-                    curve->KeySetValue(keyIndex, (float)fbxTranslation[0]);
-                    curve->KeySetInterpolation(keyIndex, KFbxAnimCurveDef::eINTERPOLATION_CUBIC);
-
-                    curve    = animCurves[nodeIndex]->ty();
-                    keyIndex = curve->KeyAdd(time);
-                    curve->KeySetValue(keyIndex, (float)fbxTranslation[1]);
-                    curve->KeySetInterpolation(keyIndex, KFbxAnimCurveDef::eINTERPOLATION_CUBIC);
-
-                    curve    = animCurves[nodeIndex]->tz();
-                    keyIndex = curve->KeyAdd(time);
-                    curve->KeySetValue(keyIndex, (float)fbxTranslation[2]);
-                    curve->KeySetInterpolation(keyIndex, KFbxAnimCurveDef::eINTERPOLATION_CUBIC);
-                }
-
-                if (updateRotation)
+            if ((stack.animCurves[nodeIndex] != NULL) && (numKeyFrames > 0))
+            {
+                FBXNodeKeys task;
+
+                task.sequence          = &sequence;
+                task.grid              = (options.fps > 0) ? &stack.grid : NULL;
+                task.numKeys           = task.grid ? task.grid->size() : numKeyFrames;
+                task.timePerFrame      = task.grid ? 1.0 / options.fps : sequence.duration / double(numKeyFrames);
+                task.curves            = stack.animCurves[nodeIndex];
+                task.node              = nodeIndex;
+                task.nodeInBaseShape   = shapeNodes[nodeIndex];
+                task.translationIndex  = translationIndex;
+                task.rotationIndex     = rotationIndex;
+                task.invertYZ          = invertYZ;
+                task.updateTranslation = (translationIndex >= 0) || invertYZ;
+                task.updateRotation    = (rotationIndex    >= 0) || invertYZ;
+
+                // Resampled poses and channels without keys come from the shape.
+                if ((task.nodeInBaseShape < 0) &&
+                    (task.grid || (task.updateTranslation && translationIndex < 0) || (task.updateRotation && rotationIndex < 0)))
                 {
-                    curve    = animCurves[nodeIndex]->rx();
-                    keyIndex = curve->KeyAdd(time);
-                    curve->KeySetValue(keyIndex, (float)fbxRotation[0]);
-                    curve->KeySetInterpolation(keyIndex, KFbxAnimCurveDef::eINTERPOLATION_CONSTANT);
-
-                    curve    = animCurves[nodeIndex]->ry();
-                    keyIndex = curve->KeyAdd(time);
-                    curve->KeySetValue(keyIndex, (float)fbxRotation[1]);
-                    curve->KeySetInterpolation(keyIndex, KFbxAnimCurveDef::eINTERPOLATION_CONSTANT);
-
-                    curve    = animCurves[nodeIndex]->rz();
-                    keyIndex = curve->KeyAdd(time);
-                    curve->KeySetValue(keyIndex, (float)fbxRotation[2]);
-                    curve->KeySetInterpolation(keyIndex, KFbxAnimCurveDef::eINTERPOLATION_CONSTANT);
+                    continue;
                 }
-            }
 
-            if (*matPosition)
-            {
-                translation++;
-            }
-                
-            if (*matRotation)
-            {
-                rotation++;
+                tasks.push_back(task);
             }
         }
     }
+}
+
+// Stage three, back on the SDK thread: hand the arrays to the curves.
+void FBXExporter::commitAnimations(FBXAnimationBatch& batch)
+{
+    std::vector<FBXSequenceStack>& stacks(batch.stacks);
+    std::vector<FBXNodeKeys>&      tasks (batch.tasks);
 
-    // Close all the curves.
+    int taskIndex, taskCount = (int)tasks.size();
+
+    for (taskIndex = 0; taskIndex < taskCount; taskIndex++)
     {
-        std::vector<AnimatedNode*>::const_iterator it, end(animCurves.end());
+        commitNodeKeys(tasks[taskIndex]);
+
+        std::vector<float>().swap(tasks[taskIndex].keys);
+    }
 
-        for (it = animCurves.begin(); it != end; ++it)
+    std::vector<FBXSequenceStack>::iterator stackIt, stackEnd(stacks.end());
+
+    for (stackIt = stacks.begin(); stackIt != stackEnd; ++stackIt)
+    {
+        if (stackIt->animStack == NULL)
+        {
+            continue;
+        }
+
+        std::vector<AnimatedNode*>::const_iterator it, end(stackIt->animCurves.end());
+
+        for (it = stackIt->animCurves.begin(); it != end; ++it)
         {
             if (*it)
             {
                 (*it)->End();
+                delete *it;
             }
         }
+
+        stackIt->animStack->AddMember(stackIt->animLayer);
+    }
+}
+
+// Same precedence as KFbxNode::FindChild: direct children first, then
+// their subtrees in order.
+static void indexChildren(KFbxNode* node, std::map<std::string, KFbxNode*>& index)
+{
+    int child, count = node->GetChildCount();
+
+    for (child = 0; child < count; child++)
+    {
+        index.insert(std::make_pair(std::string(node->GetChild(child)->GetName()), node->GetChild(child)));
     }
 
-    animStack->AddMember(animLayer);
+    for (child = 0; child < count; child++)
+    {
+        indexChildren(node->GetChild(child), index);
+    }
 }
 
-int convert(const DTSResolver& resolver, const DTSShape& shape, const std::vector<DTSShape>& files, const char* fbxFile, bool addAnim)
+// Skeleton nodes of the scene matching the node names of a sequence file.
+void FBXExporter::findSkeletonNodes(const DTSShape& file)
 {
-    FBXExporter* exporter;
-    
+    if (!sceneNodesIndexed)
+    {
+        indexChildren(scene->GetRootNode(), sceneNodes);
+        sceneNodesIndexed = true;
+    }
+
+    skeletonNodes.clear();
+
+    std::vector<std::string>::const_iterator itNames, endNames(file.names.end());
+
+    for (itNames = file.names.begin(); itNames != endNames; ++itNames)
+    {
+        std::map<std::string, KFbxNode*>::const_iterator found(sceneNodes.find(*itNames));
+
+        if (found != sceneNodes.end())
+        {
+            skeletonNodes.push_back(found->second);
+        }
+        else
+        {
+            skeletonNodes.push_back(NULL);
+            missingSceneNodes.insert(*itNames);
+        }
+
+        if (!nodeMap.nodes.empty() && nodeMap.nodes.find(*itNames) == nodeMap.nodes.end())
+        {
+            missingShapeNodes.insert(*itNames);
+        }
+    }
+}
+
+static void reportNames(const char* where, const std::set<std::string>& names)
+{
+    if (names.empty())
+    {
+        return;
+    }
+
+    fprintf(stderr, "Warning: %i sequence node names not found in the %s:", (int)names.size(), where);
+
+    std::set<std::string>::const_iterator it, end(names.end());
+
+    for (it = names.begin(); it != end; ++it)
+    {
+        fprintf(stderr, "%s %s", (it == names.begin()) ? "" : ",", (*it).c_str());
+    }
+
+    fprintf(stderr, "\n");
+}
+
+void FBXExporter::reportMissingNodes()
+{
+    reportNames("scene", missingSceneNodes);
+    reportNames("shape", missingShapeNodes);
+}
+
+// With animOutput, addanim leaves fbxFile untouched and writes its skeleton
+// and animations, old and new, to animOutput instead.
+int convert(const DTSResolver& resolver, const DTSShape& shape, const std::vector<DTSShape>& files, const char* fbxFile, bool addAnim, const DTSExportOptions& options, const char* animOutput)
+{
+    FBXExporter* exporter = new FBXExporter(addAnim ? NULL : &shape);
+
+    exporter->options = options;
+
     if (addAnim)
     {
-        exporter = new FBXExporter(NULL);
-        
-        if (!exporter->load(fbxFile) != 0)
+        // The animation file holds only the skeleton and the stacks, so it
+        // is cheap to reload. Without one yet, the skeleton comes from the
+        // target file.
+        const char* loadFile = fbxFile;
+
+        if (animOutput)
+        {
+            FILE* f = fopen(animOutput, "rb");
+
+            if (f)
+            {
+                fclose(f);
+                loadFile = animOutput;
+            }
+        }
+
+        if (!exporter->load(loadFile, animOutput != NULL) != 0)
         {
             return -1;
         }
     }
     else
     {
-        exporter = new FBXExporter(&shape);
+        if (options.mergeStatic)
+        {
+            DTSMeshMerger::findMergeableObjects(shape, files, options.mergeByNode, exporter->mergedObjects);
+        }
     
         KFbxNode*   rootNode = exporter->scene->GetRootNode();
         int         index;
@@ -1098,44 +1613,162 @@ int convert(const DTSResolver& resolver, const DTSShape& shape, const std::vecto
             }
         }
         
-        std::vector<DTSSequence>::const_iterator seqIt, seqEnd;
-        
-        {
-            std::vector<DTSSequence>::const_iterator seqIt, seqEnd(shape.sequences.end());
-            
-            for (seqIt = shape.sequences.begin(); seqIt != seqEnd; ++seqIt)
-            {
-                exporter->convertAnimation(shape, shape, *seqIt);
-            }
-        }
+        exporter->convertAnimations(shape, shape);
     }
 
     {
-        KFbxNode* skeleton = exporter->scene->GetRootNode();
-        
         std::vector<DTSShape>::const_iterator it, end(files.end());
         
+        if (addAnim)
+        {
+            exporter->nodeMap.build(shape);
+        }
+
         for (it = files.begin(); it != end; ++it)
         {
-            const DTSShape& file(*it);
-            
-            exporter->skeletonNodes.clear();
-            
-            std::vector<std::string>::const_iterator itNames, endNames(file.names.end());
-            
-            for (itNames = file.names.begin(); itNames != endNames; ++itNames)
+            exporter->findSkeletonNodes(*it);
+            exporter->convertAnimations(shape, *it);
+        }
+
+        exporter->reportMissingNodes();
+    }
+    
+    if (addAnim)
+    {
+        printf("Animations: %i added, %i replaced, %i unchanged\n", exporter->addedStacks, exporter->replacedStacks, exporter->unchangedStacks);
+    }
+
+    if (options.translationTolerance >= 0 || options.rotationTolerance >= 0)
+    {
+        printf("Keyframes: %i of %i written\n", exporter->writtenKeys, exporter->sampledKeys);
+    }
+
+    if (options.instance)
+    {
+        printf("Instancing: %i of %i meshes exported as instances\n", exporter->instancedMeshes, exporter->exportedMeshes);
+    }
+
+    if (!addAnim && !exporter->skinStreams.names.empty())
+    {
+        std::string skinFile(fbxFile);
+        size_t      length = skinFile.size();
+
+        if (length > 4 && (skinFile.compare(length - 4, 4, ".fbx") == 0 || skinFile.compare(length - 4, 4, ".FBX") == 0))
+        {
+            skinFile.erase(length - 4);
+        }
+
+        skinFile += ".skin";
+
+        if (!exporter->skinStreams.write(skinFile.c_str()))
+        {
+            fprintf(stderr, "Failed to write skin streams %s\n", skinFile.c_str());
+        }
+        else
+        {
+            printf("Skin streams: %i meshes written to %s\n", (int)exporter->skinStreams.names.size(), skinFile.c_str());
+        }
+    }
+
+    return exporter->save(animOutput ? animOutput : fbxFile);
+}
+
+int exportAnimations(const DTSShape& shape, const std::vector<DTSShape>& files, const char* directory, const DTSExportOptions& options)
+{
+    std::vector<const DTSShape*> sources;
+    std::vector<int>             sequences;
+
+    size_t index;
+
+    for (index = 0; index < shape.sequences.size(); index++)
+    {
+        sources  .push_back(&shape);
+        sequences.push_back((int)index);
+    }
+
+    std::vector<DTSShape>::const_iterator fileIt, fileEnd(files.end());
+
+    for (fileIt = files.begin(); fileIt != fileEnd; ++fileIt)
+    {
+        for (index = 0; index < (*fileIt).sequences.size(); index++)
+        {
+            sources  .push_back(&(*fileIt));
+            sequences.push_back((int)index);
+        }
+    }
+
+    std::vector<int> nodes;
+
+    for (index = 0; index < shape.nodes.size(); index++)
+    {
+        nodes.push_back((int)index);
+    }
+
+    int count = (int)sequences.size();
+    int job, failed = 0;
+
+    std::vector<const DTSSequence*> named;
+    std::vector<std::string>        names;
+
+    for (job = 0; job < count; job++)
+    {
+        named.push_back(&sources[job]->sequences[sequences[job]]);
+    }
+
+    DTSSequenceNames::fileNames(named, names);
+
+    // One SDK manager and scene per file, all driven from this thread: the
+    // SDK is not known to be safe with several managers at once. The keys
+    // of a chunk of files are baked together on the OpenMP threads, the
+    // chunk bounds the number of scenes held at once.
+    const int chunkSize = 64;
+
+    for (int first = 0; first < count; first += chunkSize)
+    {
+        int last = std::min(count, first + chunkSize);
+
+        std::vector<FBXExporter*>       exporters;
+        std::vector<FBXAnimationBatch>  batches(last - first);
+        std::vector<FBXAnimationBatch*> pending;
+
+        for (job = first; job < last; job++)
+        {
+            const DTSShape& file(*sources[job]);
+            FBXExporter*    exporter = new FBXExporter(&shape);
+
+            exporter->options = options;
+            exporter->convertSkeleton(shape, exporter->scene->GetRootNode(), nodes);
+
+            if (&file != &shape)
             {
-                exporter->skeletonNodes.push_back(skeleton->FindChild((*itNames).c_str(), true));
+                exporter->findSkeletonNodes(file);
             }
-            
-            std::vector<DTSSequence>::const_iterator seqIt, seqEnd(file.sequences.end());
-            
-            for (seqIt = file.sequences.begin(); seqIt != seqEnd; ++seqIt)
+
+            exporter->prepareAnimations(shape, file, sequences[job], batches[job - first]);
+
+            exporters.push_back(exporter);
+            pending  .push_back(&batches[job - first]);
+        }
+
+        bakeAnimations(shape, options, pending);
+
+        for (job = first; job < last; job++)
+        {
+            FBXExporter* exporter = exporters[job - first];
+
+            exporter->commitAnimations(batches[job - first]);
+
+            if (!exporter->save((std::string(directory) + "/" + names[job] + ".fbx").c_str()))
             {
-                exporter->convertAnimation(shape, file, *seqIt);
+                fprintf(stderr, "Failed to write animation %s\n", named[job]->name.c_str());
+                failed++;
             }
+
+            delete exporter;
         }
     }
-    
-    return exporter->save(fbxFile);
+
+    printf("Animations: %i of %i files written\n", count - failed, count);
+
+    return failed ? -1 : 0;
 }
@@ -0,0 +1,298 @@
+/*
+ * dts2fbx
+ * Copyright (c) 2011 Charlie Duhor. All rights reserved.
+ *
+ * @DTS2FBX_LICENSE_HEADER_START@
+ * 
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ * 
+ * @DTS2FBX_LICENSE_HEADER_START@
+ */
+
+#include "DTSAnalysis.h"
+#include "DTSMeshTools.h"
+#include "DTSVertexCache.h"
+
+#include <math.h>
+#include <algorithm>
+
+static const float BoundsTolerance = 1e-3f;  // Relative to the mesh radius
+static const float WeldEpsilon     = 1e-6f;
+
+DTSMeshMetrics::DTSMeshMetrics() :
+    analyzed          (false),
+    vertices          (0),
+    triangles         (0),
+    degenerates       (0),
+    uniqueVertices    (0),
+    cacheTransforms   (0),
+    referencedVertices(0),
+    overdraw          (0),
+    bones             (0),
+    maxInfluences     (0),
+    boundsValid       (true),
+    radiusValid       (true),
+    boundsExcess      (0),
+    radiusExcess      (0)
+{
+}
+
+void DTSAnalysis::analyzeMesh(const DTSMesh& mesh, DTSMeshMetrics& metrics)
+{
+    metrics = DTSMeshMetrics();
+
+    if (mesh.type == DTSMesh::T_Null || mesh.vertsPerFrame <= 0 || (int)mesh.verts.size() < mesh.vertsPerFrame)
+    {
+        return;
+    }
+
+    const std::vector<Point>& verts(mesh.verts);
+
+    int count = mesh.vertsPerFrame;
+    int t, v;
+
+    metrics.analyzed = true;
+    metrics.vertices = count;
+
+    DTSTriangles triangles;
+
+    DTSMeshTools::expandTriangles(mesh, triangles);
+    metrics.triangles = triangles.count();
+
+    // Degenerates and projected area along each axis, for the overdraw estimate.
+    double projected[3] = { 0, 0, 0 };
+
+    for (t = 0; t < triangles.count(); t++)
+    {
+        int a = triangles.indices[t * 3], b = triangles.indices[t * 3 + 1], c = triangles.indices[t * 3 + 2];
+
+        if (a >= count || b >= count || c >= count || a == b || b == c || a == c)
+        {
+            metrics.degenerates++;
+            continue;
+        }
+
+        double ux = verts[b].x - verts[a].x, uy = verts[b].y - verts[a].y, uz = verts[b].z - verts[a].z;
+        double vx = verts[c].x - verts[a].x, vy = verts[c].y - verts[a].y, vz = verts[c].z - verts[a].z;
+        double nx = uy * vz - uz * vy, ny = uz * vx - ux * vz, nz = ux * vy - uy * vx;
+
+        if (nx == 0 && ny == 0 && nz == 0)
+        {
+            metrics.degenerates++;
+            continue;
+        }
+
+        projected[0] += fabs(nx) * 0.5;
+        projected[1] += fabs(ny) * 0.5;
+        projected[2] += fabs(nz) * 0.5;
+    }
+
+    // Depth complexity seen along the three axes, weighted by silhouette
+    // area, half the faces being culled.
+    Point size;
+
+    size.x = mesh.bounds.max.x - mesh.bounds.min.x;
+    size.y = mesh.bounds.max.y - mesh.bounds.min.y;
+    size.z = mesh.bounds.max.z - mesh.bounds.min.z;
+
+    double silhouette = (double)size.y * size.z + (double)size.x * size.z + (double)size.x * size.y;
+
+    metrics.overdraw = silhouette > 0 ? (float)((projected[0] + projected[1] + projected[2]) * 0.5 / silhouette) : 0;
+
+    DTSCacheStats cache;
+
+    DTSVertexCache::measure(triangles, count, cache);
+    metrics.cacheTransforms    = cache.transforms;
+    metrics.referencedVertices = cache.vertices;
+
+    DTSMesh welded(mesh);
+
+    metrics.uniqueVertices = count - DTSMeshTools::weldVertices(welded, WeldEpsilon);
+
+    if (mesh.type == DTSMesh::T_Skin)
+    {
+        std::vector<int>  influences(count, 0);
+        std::vector<bool> usedBones(mesh.nodeIndex.size(), false);
+
+        for (size_t w = 0; w < mesh.vindex.size(); w++)
+        {
+            if (mesh.vindex[w] >= 0 && mesh.vindex[w] < count && mesh.vweight[w] > 0)
+            {
+                metrics.maxInfluences = std::max(metrics.maxInfluences, ++influences[mesh.vindex[w]]);
+
+                if (mesh.vbone[w] >= 0 && mesh.vbone[w] < (int)usedBones.size() && !usedBones[mesh.vbone[w]])
+                {
+                    usedBones[mesh.vbone[w]] = true;
+                    metrics.bones++;
+                }
+            }
+        }
+    }
+
+    float tolerance = BoundsTolerance * std::max(mesh.radius, 1.0f);
+
+    for (v = 0; v < count; v++)
+    {
+        const Point& p(verts[v]);
+
+        float outside = 0;
+
+        outside = std::max(outside, mesh.bounds.min.x - p.x);
+        outside = std::max(outside, mesh.bounds.min.y - p.y);
+        outside = std::max(outside, mesh.bounds.min.z - p.z);
+        outside = std::max(outside, p.x - mesh.bounds.max.x);
+        outside = std::max(outside, p.y - mesh.bounds.max.y);
+        outside = std::max(outside, p.z - mesh.bounds.max.z);
+
+        float dx = p.x - mesh.center.x, dy = p.y - mesh.center.y, dz = p.z - mesh.center.z;
+        float beyond = sqrtf(dx * dx + dy * dy + dz * dz) - mesh.radius;
+
+        metrics.boundsExcess = std::max(metrics.boundsExcess, outside);
+        metrics.radiusExcess = std::max(metrics.radiusExcess, beyond);
+    }
+
+    metrics.boundsValid = metrics.boundsExcess <= tolerance;
+    metrics.radiusValid = metrics.radiusExcess <= tolerance;
+}
+
+void DTSAnalysis::analyze(const DTSShape& shape, std::vector<DTSMeshMetrics>& metrics)
+{
+    int count = (int)shape.meshes.size();
+
+    metrics.assign(count, DTSMeshMetrics());
+
+#pragma omp parallel for schedule(dynamic)
+    for (int mesh = 0; mesh < count; mesh++)
+    {
+        if (mesh < (int)shape.meshLoaded.size() && !shape.meshLoaded[mesh])
+        {
+            continue;
+        }
+
+        analyzeMesh(shape.meshes[mesh], metrics[mesh]);
+    }
+}
+
+static void writeString(FILE* fileOut, const std::string& value)
+{
+    fputc('"', fileOut);
+
+    for (size_t i = 0; i < value.size(); i++)
+    {
+        unsigned char c = (unsigned char)value[i];
+
+        if (c == '"' || c == '\\')
+        {
+            fprintf(fileOut, "\\%c", c);
+        }
+        else if (c < 0x20)
+        {
+            fprintf(fileOut, "\\u%04x", c);
+        }
+        else
+        {
+            fputc(c, fileOut);
+        }
+    }
+
+    fputc('"', fileOut);
+}
+
+static const char* boolString(bool value)
+{
+    return value ? "true" : "false";
+}
+
+void DTSAnalysis::writeJSON(FILE* fileOut, const DTSShape& shape, const std::vector<DTSMeshMetrics>& metrics)
+{
+    int index;
+
+    fprintf(fileOut, "{\n  \"meshes\": [");
+
+    for (index = 0; index < (int)metrics.size(); index++)
+    {
+        const DTSMeshMetrics& m(metrics[index]);
+
+        fprintf(fileOut, "%s\n    { \"index\": %i, \"type\": %i, \"analyzed\": %s", index ? "," : "", index, shape.meshes[index].type, boolString(m.analyzed));
+
+        if (index < (int)shape.meshHashes.size())
+        {
+            fprintf(fileOut, ", \"hash\": \"%016llx\"", (unsigned long long)shape.meshHashes[index]);
+        }
+
+        if (m.analyzed)
+        {
+            fprintf(fileOut, ", \"vertices\": %i, \"triangles\": %i, \"degenerateTriangles\": %i, \"uniqueVertexRatio\": %.4f, \"acmr\": %.4f, \"overdraw\": %.4f, \"bones\": %i, \"maxInfluences\": %i, \"boundsValid\": %s, \"boundsExcess\": %g, \"radiusValid\": %s, \"radiusExcess\": %g",
+                    m.vertices, m.triangles, m.degenerates, m.uniqueVertexRatio(), m.acmr(), m.overdraw, m.bones, m.maxInfluences,
+                    boolString(m.boundsValid), m.boundsExcess, boolString(m.radiusValid), m.radiusExcess);
+        }
+
+        fprintf(fileOut, " }");
+    }
+
+    fprintf(fileOut, "\n  ],\n  \"detailLevels\": [");
+
+    for (index = 0; index < (int)shape.detailLevels.size(); index++)
+    {
+        const DTSDetailLevel& detail(shape.detailLevels[index]);
+
+        DTSMeshMetrics total;
+        int            meshes = 0;
+        bool           boundsValid = true, radiusValid = true;
+
+        if (detail.subshape >= 0 && detail.subshape < (int)shape.subshapes.size())
+        {
+            const DTSSubshape& subshape(shape.subshapes[detail.subshape]);
+
+            for (int object = subshape.firstObject; object < subshape.firstObject + subshape.numObjects; object++)
+            {
+                const DTSObject& dtsObject(shape.objects[object]);
+
+                if (detail.objectDetail < 0 || detail.objectDetail >= dtsObject.numMeshes || dtsObject.firstMesh + detail.objectDetail >= (int)metrics.size())
+                {
+                    continue;
+                }
+
+                const DTSMeshMetrics& m(metrics[dtsObject.firstMesh + detail.objectDetail]);
+
+                if (!m.analyzed)
+                {
+                    continue;
+                }
+
+                meshes++;
+                total.vertices        += m.vertices;
+                total.triangles       += m.triangles;
+                total.degenerates     += m.degenerates;
+                total.uniqueVertices  += m.uniqueVertices;
+                total.cacheTransforms += m.cacheTransforms;
+                total.overdraw         = std::max(total.overdraw, m.overdraw);
+                total.bones            = std::max(total.bones, m.bones);
+                total.maxInfluences    = std::max(total.maxInfluences, m.maxInfluences);
+                boundsValid            = boundsValid && m.boundsValid;
+                radiusValid            = radiusValid && m.radiusValid;
+            }
+        }
+
+        fprintf(fileOut, "%s\n    { \"index\": %i, \"name\": ", index ? "," : "", index);
+        writeString(fileOut, detail.name >= 0 && detail.name < (int)shape.names.size() ? shape.names[detail.name] : std::string());
+        fprintf(fileOut, ", \"size\": %g, \"meshes\": %i, \"vertices\": %i, \"triangles\": %i, \"degenerateTriangles\": %i, \"uniqueVertexRatio\": %.4f, \"acmr\": %.4f, \"maxOverdraw\": %.4f, \"maxBones\": %i, \"maxInfluences\": %i, \"boundsValid\": %s, \"radiusValid\": %s }",
+                detail.size, meshes, total.vertices, total.triangles, total.degenerates, total.uniqueVertexRatio(), total.acmr(), total.overdraw,
+                total.bones, total.maxInfluences, boolString(boundsValid), boolString(radiusValid));
+    }
+
+    fprintf(fileOut, "\n  ]\n}\n");
+}
@@ -0,0 +1,70 @@
+/*
+ * dts2fbx
+ * Copyright (c) 2011 Charlie Duhor. All rights reserved.
+ *
+ * @DTS2FBX_LICENSE_HEADER_START@
+ * 
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ * 
+ * @DTS2FBX_LICENSE_HEADER_START@
+ */
+
+#ifndef DTSConverter_DTSAnalysis_h
+#define DTSConverter_DTSAnalysis_h
+
+#include "DTSShape.h"
+
+#include <stdio.h>
+#include <vector>
+
+class DTSMeshMetrics
+{
+public:
+    bool  analyzed;
+    int   vertices;
+    int   triangles;            // After strip and fan expansion
+    int   degenerates;          // Repeated indices or zero area
+    int   uniqueVertices;       // Left after welding identical vertices
+    int   cacheTransforms;      // Misses of a modeled FIFO cache
+    int   referencedVertices;
+    float overdraw;             // Estimated depth complexity
+    int   bones;
+    int   maxInfluences;
+    bool  boundsValid;          // Every vertex inside DTSMesh::bounds
+    bool  radiusValid;          // Every vertex within radius of center
+    float boundsExcess;         // Largest distance outside the bounds
+    float radiusExcess;         // Largest distance beyond the radius
+
+public:
+    DTSMeshMetrics();
+
+    float uniqueVertexRatio() const { return vertices ? (float)uniqueVertices / vertices : 1; }
+    float acmr() const { return triangles ? (float)cacheTransforms / triangles : 0; }
+};
+
+class DTSAnalysis
+{
+public:
+    static void analyzeMesh(const DTSMesh& mesh, DTSMeshMetrics& metrics);
+
+    // Analyzes every loaded mesh, in parallel.
+    static void analyze(const DTSShape& shape, std::vector<DTSMeshMetrics>& metrics);
+
+    // Writes the per mesh and per detail level metrics as a JSON document.
+    static void writeJSON(FILE* fileOut, const DTSShape& shape, const std::vector<DTSMeshMetrics>& metrics);
+};
+
+#endif
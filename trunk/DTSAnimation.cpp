@@ -0,0 +1,182 @@
+/*
+ * dts2fbx
+ * Copyright (c) 2011 Charlie Duhor. All rights reserved.
+ *
+ * @DTS2FBX_LICENSE_HEADER_START@
+ * 
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ * 
+ * @DTS2FBX_LICENSE_HEADER_START@
+ */
+
+#include "DTSAnimation.h"
+#include "DTSSkeleton.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <algorithm>
+#include <set>
+
+static bool fitsLine(const float* values, int first, int last, float tolerance)
+{
+    float slope = (values[last] - values[first]) / (float)(last - first);
+
+    for (int frame = first + 1; frame < last; frame++)
+    {
+        if (fabsf(values[first] + slope * (frame - first) - values[frame]) > tolerance)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int DTSKeyReducer::reduce(const float* values, int count, float tolerance, std::vector<int>& frames)
+{
+    frames.clear();
+
+    if (count <= 0)
+    {
+        return 0;
+    }
+
+    frames.push_back(0);
+
+    bool constant = true;
+
+    for (int frame = 1; frame < count && constant; frame++)
+    {
+        constant = fabsf(values[frame] - values[0]) <= tolerance;
+    }
+
+    if (constant)
+    {
+        return 1;
+    }
+
+    // Greedy: extend every linear run as far as it holds.
+    int first = 0;
+
+    while (first < count - 1)
+    {
+        int last = first + 1;
+
+        while (last + 1 < count && fitsLine(values, first, last + 1, tolerance))
+        {
+            last++;
+        }
+
+        frames.push_back(last);
+        first = last;
+    }
+
+    return (int)frames.size();
+}
+
+void DTSKeyReducer::unwrapAngles(float* degrees, int count)
+{
+    for (int frame = 1; frame < count; frame++)
+    {
+        float delta = degrees[frame] - degrees[frame - 1];
+
+        degrees[frame] -= 360.0f * floorf(delta / 360.0f + 0.5f);
+    }
+}
+
+void DTSResampleGrid::build(const DTSSequence& sequence, float fps)
+{
+    int numFrames = (int)(sequence.duration * fps + 0.5f);
+
+    if (numFrames < 1)
+    {
+        numFrames = 1;
+    }
+
+    key0 .resize(numFrames);
+    key1 .resize(numFrames);
+    blend.resize(numFrames);
+
+    for (int frame = 0; frame < numFrames; frame++)
+    {
+        sequence.keysAt(frame / fps, key0[frame], key1[frame], blend[frame]);
+    }
+}
+
+void DTSResampleGrid::sample(const DTSShape& shape, const DTSShape& file, const std::vector<int>& shapeNodes, const DTSSequence& sequence)
+{
+    int numFrames = size();
+    int numNodes  = (int)shape.nodes.size();
+
+    DTSPoseSampler sampler;
+
+    sampler.slerp = true;
+    sampler.setSequence(shape, file, shapeNodes, sequence);
+
+    rotations   .resize(numNodes * numFrames);
+    translations.resize(numNodes * numFrames);
+
+    for (int frame = 0; frame < numFrames; frame++)
+    {
+        sampler.sampleKeys(key0[frame], key1[frame], blend[frame]);
+
+        for (int node = 0; node < numNodes; node++)
+        {
+            rotations   [node * numFrames + frame] = sampler.local.rotation   (node);
+            translations[node * numFrames + frame] = sampler.local.translation(node);
+        }
+    }
+}
+
+void DTSSequenceNames::fileNames(const std::vector<const DTSSequence*>& sequences, std::vector<std::string>& names)
+{
+    std::set<std::string> used;
+
+    names.clear();
+
+    std::vector<const DTSSequence*>::const_iterator it, end(sequences.end());
+
+    for (it = sequences.begin(); it != end; ++it)
+    {
+        std::string base((*it)->name);
+
+        std::replace(base.begin(), base.end(), '/',  '_');
+        std::replace(base.begin(), base.end(), '\\', '_');
+
+        std::string name(base);
+        int         suffix = 1;
+
+        for (;;)
+        {
+            std::string key(name);
+
+            std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+
+            if (used.insert(key).second)
+            {
+                break;
+            }
+
+            char text[16];
+
+            snprintf(text, sizeof(text), "_%i", ++suffix);
+            name = base + text;
+        }
+
+        names.push_back(name);
+    }
+}
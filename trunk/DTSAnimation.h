@@ -0,0 +1,82 @@
+/*
+ * dts2fbx
+ * Copyright (c) 2011 Charlie Duhor. All rights reserved.
+ *
+ * @DTS2FBX_LICENSE_HEADER_START@
+ * 
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ * 
+ * @DTS2FBX_LICENSE_HEADER_START@
+ */
+
+#ifndef DTSConverter_DTSAnimation_h
+#define DTSConverter_DTSAnimation_h
+
+#include "DTSShape.h"
+
+#include <vector>
+#include <string>
+
+class DTSKeyReducer
+{
+public:
+    // Picks the frames of a sampled channel to keep so that linear
+    // interpolation between them stays within tolerance of every sample.
+    // A constant channel keeps its first frame only. Returns the number of
+    // frames kept.
+    static int reduce(const float* values, int count, float tolerance, std::vector<int>& frames);
+
+    // Shifts angles (in degrees) by whole turns so consecutive samples never
+    // jump by more than half a turn and can be interpolated linearly.
+    static void unwrapAngles(float* degrees, int count);
+};
+
+// Maps the keys of a sequence onto a fixed frame rate. The grid is built
+// and sampled once per sequence, then read by every node channel.
+class DTSResampleGrid
+{
+public:
+    std::vector<int>   key0;
+    std::vector<int>   key1;
+    std::vector<float> blend;
+
+    // Local transform of every shape node at every frame, node major.
+    std::vector<Quaternion> rotations;
+    std::vector<Point>      translations;
+
+public:
+    // Frames at 0, 1 / fps, ... covering the duration of the sequence, the
+    // same span as its own keys.
+    void build(const DTSSequence& sequence, float fps);
+
+    int size() const { return (int)blend.size(); }
+
+    // Poses the shape at every frame through a DTSPoseSampler, with
+    // spherical rotation interpolation. The nodes of file map to shapeNodes
+    // as given by DTSNodeMap::match().
+    void sample(const DTSShape& shape, const DTSShape& file, const std::vector<int>& shapeNodes, const DTSSequence& sequence);
+};
+
+class DTSSequenceNames
+{
+public:
+    // One file name per sequence, without extension. Path separators are
+    // replaced, and names repeated across the shape and its sequence files
+    // (ignoring case) get a numbered suffix.
+    static void fileNames(const std::vector<const DTSSequence*>& sequences, std::vector<std::string>& names);
+};
+
+#endif
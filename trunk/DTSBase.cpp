@@ -115,6 +115,46 @@ void DTSBase::ReadCheck(int checkPoint)
     checkCount++;
 }
 
+void DTSBase::Skip32(int count)
+{
+    assert(count >= 0);
+    assert((used32 + count) <= allocated32);
+    
+    used32 += count;
+}
+
+void DTSBase::Skip16(int count)
+{
+    assert(count >= 0);
+    assert((used16 + count) <= allocated16);
+    
+    used16 += count;
+}
+
+void DTSBase::Skip8(int count)
+{
+    assert(count >= 0);
+    assert((used8 + count) <= allocated8);
+    
+    used8 += count;
+}
+
+void DTSBase::Tell(DTSStreamPosition& position) const
+{
+    position.used32     = used32;
+    position.used16     = used16;
+    position.used8      = used8;
+    position.checkCount = checkCount;
+}
+
+void DTSBase::Seek(const DTSStreamPosition& position)
+{
+    used32     = position.used32;
+    used16     = position.used16;
+    used8      = position.used8;
+    checkCount = position.checkCount;
+}
+
 void DTSBase::Read(Point& value)
 {
     Read(value.x);
@@ -146,6 +186,11 @@ void DTSBase::Read(Quaternion& value)
     value.w = (w / 32767.0f);
 }
 
+void DTSBase::Read(Quat16& value)
+{
+    Read(value.x); Read(value.y); Read(value.z); Read(value.w);
+}
+
 void DTSBase::Read(Matrix<4,4>& matrix)
 {
     float* m = matrix.data;
@@ -381,6 +426,71 @@ void DTSBase::Read(DTSMesh& value)
     }
 };
 
+// Mirrors Read(DTSMesh&), only reading the counts.
+void DTSBase::SkipMesh()
+{
+    int type, count, numVertexes;
+
+    Read(type);
+    
+    if (type == DTSMesh::T_Null) return ;
+    
+    ReadCheck() ;
+
+    // Header & Bounds
+    Skip32(3 + 6 + 3 + 1);
+
+    // Vertexes, texture coordinates & normals
+    Read(numVertexes);
+    Skip32(numVertexes * 3);
+    Read(count);
+    Skip32(count * 2);
+    Skip32(numVertexes * 3);
+    Skip8 (numVertexes);
+
+    // Primitives and other stuff
+    Read(count);
+    Skip16(count * 2);
+    Skip32(count);
+    Read(count);
+    Skip16(count);
+    Read(count);
+    Skip16(count);
+    Skip32(2);
+    ReadCheck();
+
+    if (type == DTSMesh::T_Skin)
+    {
+        Skip32(1);
+        Skip32(numVertexes * 3);
+        Skip32(numVertexes * 3);
+        Skip8 (numVertexes);
+
+        Read(count);
+        Skip32(count * 16);
+        Read(count);
+        Skip32(count * 3);
+        Read(count);
+        Skip32(count);
+        ReadCheck();
+    }
+
+    if (type == DTSMesh::T_Sorted)
+    {
+        Read(count);
+        Skip32(count * 8);
+
+        for (int array = 0; array < 4; array++)
+        {
+            Read(count);
+            Skip32(count);
+        }
+
+        Skip32(1);
+        ReadCheck();
+    }
+}
+
 void DTSBase::ReadRawTyped(FILE* file, std::string& string)
 {
     int i, l = ReadRawTyped<int>(file);
@@ -44,6 +44,15 @@ class DTSMesh;
 class DTSPrimitive;
 class DTSCluster;
 
+class DTSStreamPosition
+{
+public:
+    int used32;
+    int used16;
+    int used8;
+    int checkCount;
+};
+
 class DTSBase
 {
 protected:
@@ -92,6 +101,7 @@ public:
     void Read(Point2D&);
     void Read(Box&);
     void Read(Quaternion&);
+    void Read(Quat16&);
     void Read(Matrix<4,4>&);
     
     void Read(DTSNode&);
@@ -107,6 +117,15 @@ public:
     void Read(DTSCluster&);
     
     void ReadCheck(int checkPoint = -1);
+
+    // Advances the streams past data without decoding it.
+    void Skip32(int count);
+    void Skip16(int count);
+    void Skip8 (int count);
+    void SkipMesh();
+
+    void Tell(DTSStreamPosition&) const;
+    void Seek(const DTSStreamPosition&);
     
     template <typename DataType> void Read(std::vector<DataType>& vectorType)
     {
@@ -0,0 +1,675 @@
+/*
+ * dts2fbx
+ * Copyright (c) 2011 Charlie Duhor. All rights reserved.
+ *
+ * @DTS2FBX_LICENSE_HEADER_START@
+ * 
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ * 
+ * @DTS2FBX_LICENSE_HEADER_START@
+ */
+
+#include "DTSClip.h"
+#include "DTSMath.h"
+#include "DTSSkeleton.h"
+#include "DTSAnimation.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+
+enum
+{
+    ClipRotation    = 0,
+    ClipTranslation = 1,
+    ClipMinBits     = 3,
+    ClipMaxBits     = 16
+};
+
+class ClipTrack
+{
+public:
+    int   node;
+    int   kind;
+    int   bits;
+    float min   [3];
+    float extent[3];
+};
+
+class ClipConstant
+{
+public:
+    int   node;
+    int   kind;
+    float value[4];
+};
+
+DTSClipStats::DTSClipStats() :
+    rawBytes      (0),
+    clipBytes     (0),
+    tracks        (0),
+    constantTracks(0),
+    strippedTracks(0),
+    maxError      (0)
+{
+}
+
+void DTSClipStats::add(const DTSClipStats& other)
+{
+    rawBytes       += other.rawBytes;
+    clipBytes      += other.clipBytes;
+    tracks         += other.tracks;
+    constantTracks += other.constantTracks;
+    strippedTracks += other.strippedTracks;
+    maxError        = std::max(maxError, other.maxError);
+}
+
+static void putU8(std::vector<unsigned char>& out, unsigned int value)
+{
+    out.push_back((unsigned char)value);
+}
+
+static void putU16(std::vector<unsigned char>& out, unsigned int value)
+{
+    putU8(out, value);
+    putU8(out, value >> 8);
+}
+
+static void putU32(std::vector<unsigned char>& out, unsigned int value)
+{
+    putU16(out, value);
+    putU16(out, value >> 16);
+}
+
+static void putF32(std::vector<unsigned char>& out, float value)
+{
+    unsigned int bits;
+
+    memcpy(&bits, &value, 4);
+    putU32(out, bits);
+}
+
+static float length(const Point& p)
+{
+    return sqrtf(p.x * p.x + p.y * p.y + p.z * p.z);
+}
+
+static float distance(const Point& a, const Point& b)
+{
+    float x = a.x - b.x, y = a.y - b.y, z = a.z - b.z;
+
+    return sqrtf(x * x + y * y + z * z);
+}
+
+// Rotations only keep x, y and z, so they are stored with w >= 0.
+static void component(const Quaternion& q, float* c)
+{
+    float sign = (q.w < 0) ? -1.0f : 1.0f;
+
+    c[0] = q.x * sign;
+    c[1] = q.y * sign;
+    c[2] = q.z * sign;
+}
+
+static void component(const Point& p, float* c)
+{
+    c[0] = p.x;
+    c[1] = p.y;
+    c[2] = p.z;
+}
+
+static int quantize(float value, float min, float extent, int bits)
+{
+    int maxValue = (1 << bits) - 1;
+
+    if (extent <= 0)
+    {
+        return 0;
+    }
+
+    int q = (int)((value - min) / extent * maxValue + 0.5f);
+
+    return std::max(0, std::min(maxValue, q));
+}
+
+static float dequantize(int q, float min, float extent, int bits)
+{
+    return min + extent * q / (float)((1 << bits) - 1);
+}
+
+static Quaternion decodeRotation(const float* c)
+{
+    Quaternion q;
+
+    q.x = c[0];
+    q.y = c[1];
+    q.z = c[2];
+    q.w = sqrtf(std::max(0.0f, 1.0f - c[0] * c[0] - c[1] * c[1] - c[2] * c[2]));
+
+    float n = 1.0f / sqrtf(q.x * q.x + q.y * q.y + q.z * q.z + q.w * q.w);
+
+    q.x *= n; q.y *= n; q.z *= n; q.w *= n;
+    return q;
+}
+
+// From the chord between the unit quaternions, acos of their dot product
+// being too coarse in float for small angles.
+static float rotationAngle(const Quaternion& a, const Quaternion& b)
+{
+    float sign = (a.x * b.x + a.y * b.y + a.z * b.z + a.w * b.w < 0) ? -1.0f : 1.0f;
+    float x    = a.x - b.x * sign;
+    float y    = a.y - b.y * sign;
+    float z    = a.z - b.z * sign;
+    float w    = a.w - b.w * sign;
+
+    return 4.0f * asinf(std::min(1.0f, 0.5f * sqrtf(x * x + y * y + z * z + w * w)));
+}
+
+// Decodes a track at the given bit rate and returns its largest error, an
+// angle for rotations.
+template <typename Key>
+static float trackError(const Key* keys, int count, ClipTrack& track, int bits, Key* decoded);
+
+template <>
+float trackError<Quaternion>(const Quaternion* keys, int count, ClipTrack& track, int bits, Quaternion* decoded)
+{
+    float error = 0;
+
+    for (int key = 0; key < count; key++)
+    {
+        float c[3];
+
+        component(keys[key], c);
+
+        for (int axis = 0; axis < 3; axis++)
+        {
+            c[axis] = dequantize(quantize(c[axis], track.min[axis], track.extent[axis], bits), track.min[axis], track.extent[axis], bits);
+        }
+
+        decoded[key] = decodeRotation(c);
+        error        = std::max(error, rotationAngle(keys[key], decoded[key]));
+    }
+
+    return error;
+}
+
+template <>
+float trackError<Point>(const Point* keys, int count, ClipTrack& track, int bits, Point* decoded)
+{
+    float error = 0;
+
+    for (int key = 0; key < count; key++)
+    {
+        float c[3];
+
+        component(keys[key], c);
+
+        for (int axis = 0; axis < 3; axis++)
+        {
+            c[axis] = dequantize(quantize(c[axis], track.min[axis], track.extent[axis], bits), track.min[axis], track.extent[axis], bits);
+        }
+
+        decoded[key].x = c[0];
+        decoded[key].y = c[1];
+        decoded[key].z = c[2];
+        error          = std::max(error, distance(keys[key], decoded[key]));
+    }
+
+    return error;
+}
+
+// Classifies a track as stripped (constant at the default), constant or
+// animated, choosing the bit rate of animated ones. decoded receives the
+// keys as the runtime will see them.
+template <typename Key>
+static void encodeTrack(const Key* keys, int count, const Key& defaultKey, float tolerance, float scale,
+                        std::vector<ClipTrack>& tracks, std::vector<ClipConstant>& constants,
+                        ClipTrack& track, DTSClipStats& stats, Key* decoded)
+{
+    float c[3], first[3], defaults[3];
+    int   key, axis;
+
+    component(keys[0],    first);
+    component(defaultKey, defaults);
+
+    for (axis = 0; axis < 3; axis++)
+    {
+        track.min   [axis] = first[axis];
+        track.extent[axis] = first[axis];
+    }
+
+    for (key = 1; key < count; key++)
+    {
+        component(keys[key], c);
+
+        for (axis = 0; axis < 3; axis++)
+        {
+            track.min   [axis] = std::min(track.min   [axis], c[axis]);
+            track.extent[axis] = std::max(track.extent[axis], c[axis]);
+        }
+    }
+
+    bool constant = true, atDefault = true;
+
+    for (axis = 0; axis < 3; axis++)
+    {
+        track.extent[axis] -= track.min[axis];
+
+        constant  = constant  && (track.extent[axis] <= 1e-5f);
+        atDefault = atDefault && (fabsf(first[axis] - defaults[axis]) <= 1e-5f);
+    }
+
+    if (constant)
+    {
+        if (atDefault)
+        {
+            std::fill(decoded, decoded + count, defaultKey);
+            stats.strippedTracks++;
+        }
+        else
+        {
+            ClipConstant value;
+
+            value.node = track.node;
+            value.kind = track.kind;
+
+            memcpy(value.value, &keys[0], sizeof(Key));
+            constants.push_back(value);
+
+            std::fill(decoded, decoded + count, keys[0]);
+            stats.constantTracks++;
+        }
+
+        return;
+    }
+
+    // Smallest bit rate within tolerance, errors being scaled to world units.
+    for (track.bits = ClipMinBits; track.bits < ClipMaxBits; track.bits++)
+    {
+        if (trackError(keys, count, track, track.bits, decoded) * scale <= tolerance)
+        {
+            break;
+        }
+    }
+
+    trackError(keys, count, track, track.bits, decoded);
+    tracks.push_back(track);
+    stats.tracks++;
+}
+
+void DTSClipCompressor::compress(const DTSShape& shape, const DTSShape& file, const std::vector<int>& shapeNodes,
+                                 const DTSSequence& sequence, float maxError, std::vector<unsigned char>& clip,
+                                 DTSClipStats& stats)
+{
+    int numNodes     = (int)shape.nodes.size();
+    int numKeyFrames = std::max(sequence.numKeyFrames, 1);
+    int node, frame;
+
+    stats = DTSClipStats();
+    clip.clear();
+
+    // Original keys of every node, defaults where the sequence has none.
+    std::vector<Quaternion> rotations   (numNodes * numKeyFrames);
+    std::vector<Point>      translations(numNodes * numKeyFrames);
+    DTSPoseSampler          sampler;
+
+    sampler.setSequence(shape, file, shapeNodes, sequence);
+
+    for (frame = 0; frame < numKeyFrames; frame++)
+    {
+        sampler.sampleKeys(frame, frame, 0);
+
+        for (node = 0; node < numNodes; node++)
+        {
+            rotations   [node * numKeyFrames + frame] = sampler.local.rotation   (node);
+            translations[node * numKeyFrames + frame] = sampler.local.translation(node);
+        }
+    }
+
+    for (node = 0; node < numNodes; node++)
+    {
+        if (sampler.animatesRotation(node))
+        {
+            Quaternion* r = &rotations[node * numKeyFrames];
+
+            stats.rawBytes += 8 * numKeyFrames;
+
+            // Keys are 16 bit and slightly off unit length; measuring
+            // against them would count that as compression error.
+            for (frame = 0; frame < numKeyFrames; frame++)
+            {
+                Quaternion& q(r[frame]);
+                float       n = 1.0f / sqrtf(q.x * q.x + q.y * q.y + q.z * q.z + q.w * q.w);
+
+                q.x *= n; q.y *= n; q.z *= n; q.w *= n;
+            }
+        }
+
+        if (sampler.animatesTranslation(node))
+        {
+            stats.rawBytes += 12 * numKeyFrames;
+        }
+    }
+
+    // Reach of every node: the farthest descendant in the bind pose, or its
+    // own bone length for leaves. A rotation error moves points that far.
+    DTSSkeletonPose  bindPose;
+    std::vector<int> order;
+
+    bindPose.computeBindPose(shape);
+    DTSSkeleton::topDownOrder(shape, order);
+
+    std::vector<float> reach(numNodes, 0);
+    std::vector<int>   depth(numNodes, 1);
+    int                maxDepth = 1;
+
+    for (int index = 0; index < numNodes; index++)
+    {
+        node = order[index];
+
+        int parent = shape.nodes[node].parent;
+
+        if (parent != -1)
+        {
+            depth[node] = depth[parent] + 1;
+            maxDepth    = std::max(maxDepth, depth[node]);
+        }
+
+        reach[node] = std::max(reach[node], length(shape.nodeDefTranslations[node]));
+
+        for (parent = shape.nodes[node].parent; parent != -1; parent = shape.nodes[parent].parent)
+        {
+            reach[parent] = std::max(reach[parent], distance(bindPose.translation(node), bindPose.translation(parent)));
+        }
+    }
+
+    // Errors add up along a chain, each track gets its share of the budget.
+    float tolerance = maxError / (2.0f * maxDepth);
+
+    std::vector<Quaternion>   decodedRotations   (rotations   .size());
+    std::vector<Point>        decodedTranslations(translations.size());
+    std::vector<ClipTrack>    tracks;
+    std::vector<ClipConstant> constants;
+
+    for (node = 0; node < numNodes; node++)
+    {
+        ClipTrack track;
+
+        track.node = node;
+        track.bits = 0;
+
+        if (sampler.animatesRotation(node))
+        {
+            track.kind = ClipRotation;
+            encodeTrack(&rotations[node * numKeyFrames], numKeyFrames, shape.nodeDefRotations[node], tolerance, reach[node],
+                        tracks, constants, track, stats, &decodedRotations[node * numKeyFrames]);
+        }
+        else
+        {
+            std::copy(&rotations[node * numKeyFrames], &rotations[node * numKeyFrames] + numKeyFrames, &decodedRotations[node * numKeyFrames]);
+        }
+
+        if (sampler.animatesTranslation(node))
+        {
+            track.kind = ClipTranslation;
+            encodeTrack(&translations[node * numKeyFrames], numKeyFrames, shape.nodeDefTranslations[node], tolerance, 1.0f,
+                        tracks, constants, track, stats, &decodedTranslations[node * numKeyFrames]);
+        }
+        else
+        {
+            std::copy(&translations[node * numKeyFrames], &translations[node * numKeyFrames] + numKeyFrames, &decodedTranslations[node * numKeyFrames]);
+        }
+    }
+
+    // Measure the actual error on world positions, and on a point at the
+    // reach of every node to account for rotations at the leaves.
+    DTSSkeletonPose original, decoded, originalWorld, decodedWorld;
+
+    original.resize(numNodes);
+    decoded .resize(numNodes);
+
+    for (frame = 0; frame < numKeyFrames; frame++)
+    {
+        for (node = 0; node < numNodes; node++)
+        {
+            const Quaternion& r0(rotations          [node * numKeyFrames + frame]);
+            const Quaternion& r1(decodedRotations   [node * numKeyFrames + frame]);
+            const Point&      t0(translations       [node * numKeyFrames + frame]);
+            const Point&      t1(decodedTranslations[node * numKeyFrames + frame]);
+
+            original.qx[node] = r0.x; original.qy[node] = r0.y; original.qz[node] = r0.z; original.qw[node] = r0.w;
+            original.tx[node] = t0.x; original.ty[node] = t0.y; original.tz[node] = t0.z;
+            decoded .qx[node] = r1.x; decoded .qy[node] = r1.y; decoded .qz[node] = r1.z; decoded .qw[node] = r1.w;
+            decoded .tx[node] = t1.x; decoded .ty[node] = t1.y; decoded .tz[node] = t1.z;
+        }
+
+        originalWorld.composeWorld(shape, order, original);
+        decodedWorld .composeWorld(shape, order, decoded);
+
+        for (node = 0; node < numNodes; node++)
+        {
+            Point probe;
+
+            probe.x = reach[node];
+            probe.y = 0;
+            probe.z = 0;
+
+            Point p0(originalWorld.translation(node));
+            Point p1(decodedWorld .translation(node));
+            Point o0(DTSMath::rotate(originalWorld.rotation(node), probe));
+            Point o1(DTSMath::rotate(decodedWorld .rotation(node), probe));
+
+            stats.maxError = std::max(stats.maxError, distance(p0, p1));
+
+            p0.x += o0.x; p0.y += o0.y; p0.z += o0.z;
+            p1.x += o1.x; p1.y += o1.y; p1.z += o1.z;
+
+            stats.maxError = std::max(stats.maxError, distance(p0, p1));
+        }
+    }
+
+    // Header and tables.
+    int frameBits = 0;
+
+    std::vector<ClipTrack>::const_iterator trackIt, trackEnd(tracks.end());
+
+    for (trackIt = tracks.begin(); trackIt != trackEnd; ++trackIt)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            frameBits += ((*trackIt).extent[axis] > 0) ? (*trackIt).bits : 0;
+        }
+    }
+
+    int frameBytes = (frameBits + 7) / 8;
+
+    clip.push_back('D'); clip.push_back('C'); clip.push_back('L'); clip.push_back('P');
+    putU16(clip, 1);
+    putU16(clip, (unsigned int)sequence.name.size());
+    clip.insert(clip.end(), sequence.name.begin(), sequence.name.end());
+    putU32(clip, sequence.numKeyFrames);
+    putF32(clip, sequence.duration);
+    putU32(clip, sequence.flags);
+    putU16(clip, (unsigned int)constants.size());
+    putU16(clip, (unsigned int)tracks.size());
+    putU32(clip, frameBytes);
+
+    std::vector<ClipConstant>::const_iterator constIt, constEnd(constants.end());
+
+    for (constIt = constants.begin(); constIt != constEnd; ++constIt)
+    {
+        putU16(clip, (*constIt).node);
+        putU8 (clip, (*constIt).kind);
+        putU8 (clip, 0);
+
+        for (int axis = 0; axis < ((*constIt).kind == ClipRotation ? 4 : 3); axis++)
+        {
+            putF32(clip, (*constIt).value[axis]);
+        }
+    }
+
+    for (trackIt = tracks.begin(); trackIt != trackEnd; ++trackIt)
+    {
+        putU16(clip, (*trackIt).node);
+        putU8 (clip, (*trackIt).kind);
+        putU8 (clip, (*trackIt).bits);
+
+        for (int axis = 0; axis < 3; axis++) putF32(clip, (*trackIt).min[axis]);
+        for (int axis = 0; axis < 3; axis++) putF32(clip, (*trackIt).extent[axis]);
+    }
+
+    // Frame major key stream.
+    for (frame = 0; frame < sequence.numKeyFrames; frame++)
+    {
+        unsigned int accumulator = 0;
+        int          pending = 0;
+
+        for (trackIt = tracks.begin(); trackIt != trackEnd; ++trackIt)
+        {
+            const ClipTrack& track(*trackIt);
+            float            c[3];
+
+            if (track.kind == ClipRotation)
+            {
+                component(rotations[track.node * numKeyFrames + frame], c);
+            }
+            else
+            {
+                component(translations[track.node * numKeyFrames + frame], c);
+            }
+
+            for (int axis = 0; axis < 3; axis++)
+            {
+                if (track.extent[axis] <= 0)
+                {
+                    continue;
+                }
+
+                accumulator |= (unsigned int)quantize(c[axis], track.min[axis], track.extent[axis], track.bits) << pending;
+                pending     += track.bits;
+
+                while (pending >= 8)
+                {
+                    putU8(clip, accumulator & 0xff);
+                    accumulator >>= 8;
+                    pending      -= 8;
+                }
+            }
+        }
+
+        if (pending > 0)
+        {
+            putU8(clip, accumulator);
+        }
+    }
+
+    stats.clipBytes = (int)clip.size();
+}
+
+int DTSClipCompressor::exportClips(const DTSShape& shape, const std::vector<DTSShape>& files,
+                                   const char* directory, float maxError)
+{
+    std::vector<const DTSShape*>    sources;
+    std::vector<const DTSSequence*> sequences;
+    std::vector<int>                sourceNodes;  // Index in fileNodes
+
+    // Node names are matched once per file.
+    DTSNodeMap                     nodeMap(shape);
+    std::vector<std::vector<int> > fileNodes(files.size() + 1);
+
+    size_t index;
+
+    nodeMap.match(shape, shape, fileNodes[0]);
+
+    for (index = 0; index < shape.sequences.size(); index++)
+    {
+        sources    .push_back(&shape);
+        sequences  .push_back(&shape.sequences[index]);
+        sourceNodes.push_back(0);
+    }
+
+    std::vector<DTSShape>::const_iterator fileIt, fileEnd(files.end());
+    int                                   fileIndex;
+
+    for (fileIt = files.begin(), fileIndex = 1; fileIt != fileEnd; ++fileIt, ++fileIndex)
+    {
+        nodeMap.match(shape, *fileIt, fileNodes[fileIndex]);
+
+        for (index = 0; index < (*fileIt).sequences.size(); index++)
+        {
+            sources    .push_back(&(*fileIt));
+            sequences  .push_back(&(*fileIt).sequences[index]);
+            sourceNodes.push_back(fileIndex);
+        }
+    }
+
+    int count = (int)sequences.size();
+
+    std::vector<DTSClipStats> stats (count);
+    std::vector<int>          errors(count, 0);
+    std::vector<std::string>  names;
+    int                       clipIndex;
+
+    DTSSequenceNames::fileNames(sequences, names);
+
+#pragma omp parallel for schedule(dynamic)
+    for (clipIndex = 0; clipIndex < count; clipIndex++)
+    {
+        std::vector<unsigned char> clip;
+
+        compress(shape, *sources[clipIndex], fileNodes[sourceNodes[clipIndex]], *sequences[clipIndex], maxError, clip, stats[clipIndex]);
+
+        std::string path(std::string(directory) + "/" + names[clipIndex] + ".clip");
+        FILE*       f = fopen(path.c_str(), "wb");
+
+        if (f == NULL || fwrite(&clip[0], 1, clip.size(), f) != clip.size())
+        {
+            errors[clipIndex] = f ? EIO : errno;
+        }
+
+        if (f)
+        {
+            fclose(f);
+        }
+    }
+
+    DTSClipStats total;
+    int          result = 0;
+
+    for (clipIndex = 0; clipIndex < count; clipIndex++)
+    {
+        const DTSClipStats& s(stats[clipIndex]);
+
+        if (errors[clipIndex])
+        {
+            fprintf(stderr, "Failed to write clip %s: %s\n", sequences[clipIndex]->name.c_str(), strerror(errors[clipIndex]));
+            result = -1;
+            continue;
+        }
+
+        printf("%s: %i -> %i bytes (%.2f:1), %i tracks, %i constant, %i stripped, max error %f\n",
+               sequences[clipIndex]->name.c_str(), s.rawBytes, s.clipBytes, s.ratio(),
+               s.tracks, s.constantTracks, s.strippedTracks, s.maxError);
+
+        total.add(s);
+    }
+
+    printf("Clips: %i, %i -> %i bytes (%.2f:1), max error %f\n", count, total.rawBytes, total.clipBytes, total.ratio(), total.maxError);
+
+    return result;
+}
@@ -0,0 +1,81 @@
+/*
+ * dts2fbx
+ * Copyright (c) 2011 Charlie Duhor. All rights reserved.
+ *
+ * @DTS2FBX_LICENSE_HEADER_START@
+ * 
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ * 
+ * @DTS2FBX_LICENSE_HEADER_START@
+ */
+
+#ifndef DTSConverter_DTSClip_h
+#define DTSConverter_DTSClip_h
+
+#include "DTSShape.h"
+
+#include <vector>
+
+// Runtime clip layout, little endian:
+//
+//   char[4] "DCLP", u16 version, u16 name length, name
+//   u32 numKeyFrames, f32 duration, u32 flags
+//   u16 numConstants, u16 numTracks, u32 frameBytes
+//   constants: u16 node, u8 kind, u8 0, f32[4] rotation or f32[3] translation
+//   tracks:    u16 node, u8 kind, u8 bits, f32[3] min, f32[3] extent
+//   numKeyFrames frames of frameBytes: for every track, x, y and z of
+//   bits each, least significant bit first, padded to a byte. Components
+//   with a zero extent take no bits.
+//
+// Kind 0 is a rotation, stored as x, y, z with w >= 0 rebuilt on decoding,
+// kind 1 a translation. Nodes absent from both tables keep their default
+// transform. Frames have a fixed size so they stream or seek directly.
+class DTSClipStats
+{
+public:
+    int   rawBytes;         // Keys as stored in shape files
+    int   clipBytes;
+    int   tracks;
+    int   constantTracks;
+    int   strippedTracks;   // Constant at the node default
+    float maxError;         // World space, over every node and frame
+
+public:
+    DTSClipStats();
+
+    void  add(const DTSClipStats& other);
+    float ratio() const { return clipBytes ? (float)rawBytes / clipBytes : 0; }
+};
+
+class DTSClipCompressor
+{
+public:
+    // Encodes a sequence of file, the shape itself or a sequence file whose
+    // nodes map to shapeNodes (see DTSNodeMap::match()). Bit rates are picked
+    // per track so that the error seen in world space, through the
+    // hierarchy, stays under maxError.
+    static void compress(const DTSShape& shape, const DTSShape& file, const std::vector<int>& shapeNodes,
+                         const DTSSequence& sequence, float maxError, std::vector<unsigned char>& clip,
+                         DTSClipStats& stats);
+
+    // Writes <directory>/<sequence>.clip for every sequence of the shape and
+    // of the sequence files, in parallel, and reports the results. Repeated
+    // names get a numbered suffix.
+    static int exportClips(const DTSShape& shape, const std::vector<DTSShape>& files,
+                           const char* directory, float maxError);
+};
+
+#endif
@@ -0,0 +1,66 @@
+/*
+ * dts2fbx
+ * Copyright (c) 2011 Charlie Duhor. All rights reserved.
+ *
+ * @DTS2FBX_LICENSE_HEADER_START@
+ * 
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ * 
+ * @DTS2FBX_LICENSE_HEADER_START@
+ */
+
+#ifndef DTSConverter_DTSExportOptions_h
+#define DTSConverter_DTSExportOptions_h
+
+class DTSExportOptions
+{
+public:
+    int  paletteSize;  // Largest bone count of an exported skinned mesh, 0 for no limit
+    bool mergeStatic;  // Merge the static meshes of a detail level by material
+    bool mergeByNode;  // Also keep meshes of different nodes apart, instead of baking transforms
+    bool instance;     // Export identical static meshes once, shared by their nodes
+
+    // Keyframe reduction tolerances, in shape units and degrees; negative
+    // to write every frame.
+    float translationTolerance;
+    float rotationTolerance;
+
+    float fps;         // Resample sequences to this rate, 0 to keep their keys
+
+    // Vertical resolution in pixels the detail level sizes are compared
+    // against to get the LOD group thresholds; 1080 by default.
+    float screenHeight;
+
+    // Bone influences per vertex of the skin streams written next to the
+    // FBX file, 0 to write none.
+    int maxInfluences;
+
+public:
+    DTSExportOptions() :
+        paletteSize(0),
+        mergeStatic(false),
+        mergeByNode(false),
+        instance   (false),
+        translationTolerance(-1),
+        rotationTolerance   (-1),
+        fps                 (0),
+        screenHeight        (1080),
+        maxInfluences       (0)
+    {
+    }
+};
+
+#endif
@@ -0,0 +1,192 @@
+/*
+ * dts2fbx
+ * Copyright (c) 2011 Charlie Duhor. All rights reserved.
+ *
+ * @DTS2FBX_LICENSE_HEADER_START@
+ * 
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ * 
+ * @DTS2FBX_LICENSE_HEADER_START@
+ */
+
+#define _USE_MATH_DEFINES
+
+#include "DTSMath.h"
+#include <math.h>
+
+static const float RadToDeg = (float)(180.0 / M_PI);
+static const float HalfSqrt2 = 0.70710678118654752f;
+
+static inline float wrapNear(float angle, float reference)
+{
+    return angle + 360.0f * floorf((reference - angle) / 360.0f + 0.5f);
+}
+
+void DTSMath::quaternionsToEuler(const Quaternion* rotations, int count, bool swapAxis,
+                                 float* x, float* y, float* z)
+{
+    int index;
+
+    // Closed form of the rotation matrix of the conjugated quaternion
+    // (optionally premultiplied by the axis change), then FBX XYZ extraction
+    // (R = Rz * Ry * Rx). The swapAxis test does not change within the loop,
+    // the gimbal lock fallback is the only branch taken per key.
+    for (index = 0; index < count; index++)
+    {
+        const Quaternion& q(rotations[index]);
+
+        float qx, qy, qz, qw;
+
+        if (swapAxis)
+        {
+            // (0, s, s, 0) * conjugate(q)
+            qx = HalfSqrt2 * ( q.z - q.y);
+            qy = HalfSqrt2 * (-q.w + q.x);
+            qz = HalfSqrt2 * (-q.w - q.x);
+            qw = HalfSqrt2 * (-q.y - q.z);
+        }
+        else
+        {
+            qx =  q.x;
+            qy =  q.y;
+            qz =  q.z;
+            qw = -q.w;
+        }
+
+        float norm = qx * qx + qy * qy + qz * qz + qw * qw;
+        float s    = (norm > 0.0f) ? (2.0f / norm) : 0.0f;
+
+        float m00 = 1.0f - s * (qy * qy + qz * qz);
+        float m10 =        s * (qx * qy + qz * qw);
+        float m20 =        s * (qx * qz - qy * qw);
+        float m21 =        s * (qy * qz + qx * qw);
+        float m22 = 1.0f - s * (qx * qx + qy * qy);
+        float m11 = 1.0f - s * (qx * qx + qz * qz);
+        float m12 =        s * (qy * qz - qx * qw);
+
+        float sinY = -m20;
+
+        if (sinY >  1.0f) sinY =  1.0f;
+        if (sinY < -1.0f) sinY = -1.0f;
+
+        float cosY = sqrtf(m00 * m00 + m10 * m10);
+
+        if (cosY > 1e-5f)
+        {
+            x[index] = atan2f(m21, m22) * RadToDeg;
+            y[index] = asinf (sinY)     * RadToDeg;
+            z[index] = atan2f(m10, m00) * RadToDeg;
+        }
+        else
+        {
+            x[index] = atan2f(-m12, m11) * RadToDeg;
+            y[index] = asinf (sinY)      * RadToDeg;
+            z[index] = 0.0f;
+        }
+    }
+
+    // Continuity: pick, for every key, the equivalent triplet (direct or
+    // flipped solution, modulo 360) closest to the previous key.
+    for (index = 1; index < count; index++)
+    {
+        float px = x[index - 1], py = y[index - 1], pz = z[index - 1];
+
+        float ax = wrapNear(x[index], px);
+        float ay = wrapNear(y[index], py);
+        float az = wrapNear(z[index], pz);
+
+        float bx = wrapNear(x[index] + 180.0f, px);
+        float by = wrapNear(180.0f - y[index], py);
+        float bz = wrapNear(z[index] + 180.0f, pz);
+
+        float da = fabsf(ax - px) + fabsf(ay - py) + fabsf(az - pz);
+        float db = fabsf(bx - px) + fabsf(by - py) + fabsf(bz - pz);
+
+        if (db < da)
+        {
+            x[index] = bx; y[index] = by; z[index] = bz;
+        }
+        else
+        {
+            x[index] = ax; y[index] = ay; z[index] = az;
+        }
+    }
+}
+
+void DTSMath::quaternionToEuler(const Quaternion& rotation, bool swapAxis, float& x, float& y, float& z)
+{
+    quaternionsToEuler(&rotation, 1, swapAxis, &x, &y, &z);
+}
+
+void DTSMath::swapAxis(Point& point)
+{
+    float y = point.y;
+
+    point.x = -point.x;
+    point.y =  point.z;
+    point.z =  y;
+}
+
+Quaternion DTSMath::compose(const Quaternion& a, const Quaternion& b)
+{
+    Quaternion r;
+
+    r.w = a.w * b.w - a.x * b.x - a.y * b.y - a.z * b.z;
+    r.x = a.w * b.x + a.x * b.w + a.y * b.z - a.z * b.y;
+    r.y = a.w * b.y - a.x * b.z + a.y * b.w + a.z * b.x;
+    r.z = a.w * b.z + a.x * b.y - a.y * b.x + a.z * b.w;
+    return r;
+}
+
+Point DTSMath::rotate(const Quaternion& q, const Point& p)
+{
+    // v' = conj(q) * v * q, expanded with t = 2 * cross(-q.xyz, v)
+    float x = -q.x, y = -q.y, z = -q.z;
+
+    float tx = 2.0f * (y * p.z - z * p.y);
+    float ty = 2.0f * (z * p.x - x * p.z);
+    float tz = 2.0f * (x * p.y - y * p.x);
+
+    Point r;
+
+    r.x = p.x + q.w * tx + (y * tz - z * ty);
+    r.y = p.y + q.w * ty + (z * tx - x * tz);
+    r.z = p.z + q.w * tz + (x * ty - y * tx);
+    return r;
+}
+
+void DTSMath::toMatrix(const Quaternion& q, const Point& t, Matrix<4,4>& matrix)
+{
+    float  x = -q.x, y = -q.y, z = -q.z, w = q.w;
+    float* m = matrix.data;
+
+    m[ 0] = 1.0f - 2.0f * (y * y + z * z);
+    m[ 1] =        2.0f * (x * y - z * w);
+    m[ 2] =        2.0f * (x * z + y * w);
+    m[ 3] = t.x;
+    m[ 4] =        2.0f * (x * y + z * w);
+    m[ 5] = 1.0f - 2.0f * (x * x + z * z);
+    m[ 6] =        2.0f * (y * z - x * w);
+    m[ 7] = t.y;
+    m[ 8] =        2.0f * (x * z - y * w);
+    m[ 9] =        2.0f * (y * z + x * w);
+    m[10] = 1.0f - 2.0f * (x * x + y * y);
+    m[11] = t.z;
+    m[12] = 0.0f;
+    m[13] = 0.0f;
+    m[14] = 0.0f;
+    m[15] = 1.0f;
+}
@@ -0,0 +1,55 @@
+/*
+ * dts2fbx
+ * Copyright (c) 2011 Charlie Duhor. All rights reserved.
+ *
+ * @DTS2FBX_LICENSE_HEADER_START@
+ * 
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ * 
+ * @DTS2FBX_LICENSE_HEADER_START@
+ */
+
+#ifndef DTSConverter_DTSMath_h
+#define DTSConverter_DTSMath_h
+
+#include "DTSTypes.h"
+
+class DTSMath
+{
+public:
+    // Converts an array of DTS rotations to FBX Euler XYZ angles (degrees).
+    // DTS quaternions are conjugated on the way, and when swapAxis is set the
+    // DTS to FBX axis change (x -> -x, y <-> z) is folded into the result.
+    // Consecutive keys are kept continuous (no 360 degree or gimbal flips).
+    static void quaternionsToEuler(const Quaternion* rotations, int count, bool swapAxis,
+                                   float* x, float* y, float* z);
+
+    static void quaternionToEuler(const Quaternion& rotation, bool swapAxis, float& x, float& y, float& z);
+
+    // Applies the DTS to FBX axis change to a position.
+    static void swapAxis(Point& point);
+
+    // DTS rotations are stored conjugated: the rotation applied to a vector
+    // is the one of the conjugate. compose() returns the world rotation of a
+    // node from its local and parent rotations, rotate() applies a rotation.
+    static Quaternion compose(const Quaternion& local, const Quaternion& parent);
+    static Point      rotate (const Quaternion& rotation, const Point& point);
+
+    // Row major 4x4, translation in the last column (the nodeTransform layout).
+    static void toMatrix(const Quaternion& rotation, const Point& translation, Matrix<4,4>& matrix);
+};
+
+#endif
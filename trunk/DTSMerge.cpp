@@ -0,0 +1,360 @@
+/*
+ * dts2fbx
+ * Copyright (c) 2011 Charlie Duhor. All rights reserved.
+ *
+ * @DTS2FBX_LICENSE_HEADER_START@
+ * 
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ * 
+ * @DTS2FBX_LICENSE_HEADER_START@
+ */
+
+#include "DTSMerge.h"
+#include "DTSMath.h"
+#include "DTSMeshTools.h"
+#include "DTSSkeleton.h"
+
+#include <math.h>
+#include <algorithm>
+#include <map>
+
+static const int MaxVertices = 65535;  // Indices are unsigned shorts
+static const int MaxIndices  = DTSMeshTools::MaxIndices;
+
+static bool isStatic(const DTSMesh& mesh)
+{
+    return mesh.type == DTSMesh::T_Standard && mesh.numFrames <= 1 && mesh.matFrames <= 1;
+}
+
+// Strips and fans take more indices once expanded to lists.
+static int expandedIndices(const DTSMesh& mesh)
+{
+    int count = 0;
+
+    std::vector<DTSPrimitive>::const_iterator primIt, primEnd(mesh.primitives.end());
+
+    for (primIt = mesh.primitives.begin(); primIt != primEnd; ++primIt)
+    {
+        int elements = (*primIt).numElements;
+
+        count += ((*primIt).type >> 30) == 0 ? elements : (elements > 2 ? (elements - 2) * 3 : 0);
+    }
+
+    return count;
+}
+
+static bool isAnimated(const DTSSequence& sequence, int node)
+{
+    return (node < (int)sequence.matters.rotation   .size() && sequence.matters.rotation   [node]) ||
+           (node < (int)sequence.matters.translation.size() && sequence.matters.translation[node]) ||
+           (node < (int)sequence.matters.scale      .size() && sequence.matters.scale      [node]);
+}
+
+void DTSMeshMerger::findMergeableObjects(const DTSShape& shape, const std::vector<DTSShape>& sequenceFiles, bool byNode, std::vector<bool>& mergeable)
+{
+    int numNodes   = (int)shape.nodes.size();
+    int numObjects = (int)shape.objects.size();
+    int node, object;
+
+    std::vector<bool> animated(numNodes, false);
+
+    std::vector<DTSSequence>::const_iterator seqIt, seqEnd(shape.sequences.end());
+
+    for (seqIt = shape.sequences.begin(); seqIt != seqEnd; ++seqIt)
+    {
+        for (node = 0; node < numNodes; node++)
+        {
+            animated[node] = animated[node] || isAnimated(*seqIt, node);
+        }
+    }
+
+    DTSNodeMap       nodeMap(shape);
+    std::vector<int> shapeNodes;
+
+    std::vector<DTSShape>::const_iterator fileIt, fileEnd(sequenceFiles.end());
+
+    for (fileIt = sequenceFiles.begin(); fileIt != fileEnd; ++fileIt)
+    {
+        nodeMap.match(shape, *fileIt, shapeNodes);
+
+        for (seqIt = (*fileIt).sequences.begin(), seqEnd = (*fileIt).sequences.end(); seqIt != seqEnd; ++seqIt)
+        {
+            for (size_t fileNode = 0; fileNode < (*fileIt).names.size(); fileNode++)
+            {
+                if (isAnimated(*seqIt, (int)fileNode) && shapeNodes[fileNode] != -1)
+                {
+                    animated[shapeNodes[fileNode]] = true;
+                }
+            }
+        }
+    }
+
+    // A node moves when any of its ancestors does.
+    std::vector<int> order;
+
+    DTSSkeleton::topDownOrder(shape, order);
+
+    for (int index = 0; index < numNodes; index++)
+    {
+        node = order[index];
+
+        if (shape.nodes[node].parent != -1 && animated[shape.nodes[node].parent])
+        {
+            animated[node] = true;
+        }
+    }
+
+    mergeable.assign(numObjects, false);
+
+    for (object = 0; object < numObjects; object++)
+    {
+        const DTSObject& dtsObject(shape.objects[object]);
+
+        bool candidate = byNode || dtsObject.node < 0 || dtsObject.node >= numNodes || !animated[dtsObject.node];
+        bool hasMesh   = false;
+
+        for (int mesh = dtsObject.firstMesh; candidate && mesh < dtsObject.firstMesh + dtsObject.numMeshes; mesh++)
+        {
+            const DTSMesh& dtsMesh(shape.meshes[mesh]);
+
+            if (dtsMesh.type == DTSMesh::T_Null || !shape.meshLoaded[mesh])
+            {
+                continue;
+            }
+
+            candidate = isStatic(dtsMesh) && expandedIndices(dtsMesh) <= MaxIndices;
+            hasMesh   = true;
+        }
+
+        mergeable[object] = candidate && hasMesh;
+    }
+}
+
+class MergeBucket
+{
+public:
+    int material;
+    int node;
+    int type;
+    int result;   // Index in the merged list
+};
+
+void DTSMeshMerger::merge(const DTSShape& shape, int detailLevel, const std::vector<bool>& mergeable, bool byNode, std::vector<DTSMergedMesh>& merged)
+{
+    merged.clear();
+
+    if (detailLevel < 0 || detailLevel >= (int)shape.detailLevels.size())
+    {
+        return;
+    }
+
+    const DTSDetailLevel& detail(shape.detailLevels[detailLevel]);
+
+    if (detail.subshape < 0 || detail.subshape >= (int)shape.subshapes.size() || detail.objectDetail < 0)
+    {
+        return;
+    }
+
+    const DTSSubshape& subshape(shape.subshapes[detail.subshape]);
+
+    DTSSkeletonPose pose;
+
+    if (!byNode)
+    {
+        pose.computeBindPose(shape);
+    }
+
+    std::map<std::pair<int,int>, int> buckets;   // (material, node) -> merged mesh being filled
+    std::vector<DTSTriangles>         triangles; // Per merged mesh, flattened at the end
+    std::vector<int>                  types;
+    std::vector<int>                  vertexResult;  // Merged mesh holding the last copy of a source vertex
+    std::vector<int>                  vertexIndex;
+    std::vector<int>                  touched;
+    Point2D                           noTVert;
+
+    noTVert.x = noTVert.y = 0;
+
+    for (int object = subshape.firstObject; object < subshape.firstObject + subshape.numObjects; object++)
+    {
+        const DTSObject& dtsObject(shape.objects[object]);
+
+        if (!mergeable[object] || detail.objectDetail >= dtsObject.numMeshes)
+        {
+            continue;
+        }
+
+        int            meshIndex = dtsObject.firstMesh + detail.objectDetail;
+        const DTSMesh& mesh(shape.meshes[meshIndex]);
+
+        if (!shape.meshLoaded[meshIndex] || !isStatic(mesh) || mesh.vertsPerFrame <= 0 || (int)mesh.verts.size() < mesh.vertsPerFrame)
+        {
+            continue;
+        }
+
+        int        count = mesh.vertsPerFrame;
+        int        node  = byNode ? dtsObject.node : -1;
+        Quaternion rotation;
+        Point      translation;
+
+        if (!byNode && dtsObject.node >= 0 && dtsObject.node < (int)shape.nodes.size())
+        {
+            rotation    = pose.rotation   (dtsObject.node);
+            translation = pose.translation(dtsObject.node);
+        }
+        else
+        {
+            rotation.x = rotation.y = rotation.z = 0; rotation.w = 1;
+            translation.x = translation.y = translation.z = 0;
+        }
+
+        DTSTriangles      source;
+        DTSDecodedNormals normals;
+
+        DTSMeshTools::expandTriangles(mesh, source);
+        DTSMeshTools::decodeNormals(mesh, count, normals);
+
+        vertexResult.assign(count, -1);
+        vertexIndex .assign(count, -1);
+        touched.clear();
+
+        for (int t = 0; t < source.count(); t++)
+        {
+            int material = source.materials[t];
+
+            std::pair<int,int>                          key(material, node);
+            std::map<std::pair<int,int>, int>::iterator found = buckets.find(key);
+            int                                         result;
+
+            if (found == buckets.end() ||
+                (std::find(touched.begin(), touched.end(), found->second) == touched.end() &&
+                 (merged[found->second].mesh.vertsPerFrame + count > MaxVertices ||
+                  (int)(triangles[found->second].indices.size() + source.indices.size()) > MaxIndices)))
+            {
+                // New merged mesh, also when the current one cannot take this source whole.
+                result = (int)merged.size();
+                merged.push_back(DTSMergedMesh());
+                triangles.push_back(DTSTriangles());
+                types.push_back(material);
+
+                merged[result].material = material;
+                merged[result].node     = node;
+                merged[result].mesh.type      = DTSMesh::T_Standard;
+                merged[result].mesh.numFrames = 1;
+                merged[result].mesh.matFrames = 1;
+
+                for (size_t p = 0; p < mesh.primitives.size(); p++)
+                {
+                    if ((mesh.primitives[p].type & 0xffff) == material)
+                    {
+                        types[result] = mesh.primitives[p].type & 0x3fffffff;
+                        break;
+                    }
+                }
+
+                buckets[key] = result;
+            }
+            else
+            {
+                result = found->second;
+            }
+
+            DTSMergedMesh& target(merged[result]);
+
+            if (std::find(touched.begin(), touched.end(), result) == touched.end())
+            {
+                DTSSubmesh submesh;
+
+                submesh.object       = object;
+                submesh.mesh         = meshIndex;
+                submesh.firstElement = (int)triangles[result].indices.size();
+                submesh.numElements  = 0;
+                submesh.firstVertex  = target.mesh.vertsPerFrame;
+                submesh.numVertices  = 0;
+
+                target.submeshes.push_back(submesh);
+                touched.push_back(result);
+            }
+
+            for (int corner = 0; corner < 3; corner++)
+            {
+                int v = source.indices[t * 3 + corner];
+
+                if (vertexResult[v] != result)
+                {
+                    // First use in this merged mesh: bake and append the vertex.
+                    Point p = DTSMath::rotate(rotation, mesh.verts[v]);
+                    Point n;
+
+                    p.x += translation.x; p.y += translation.y; p.z += translation.z;
+
+                    n.x = normals.x[v]; n.y = normals.y[v]; n.z = normals.z[v];
+                    n   = DTSMath::rotate(rotation, n);
+
+                    vertexResult[v] = result;
+                    vertexIndex [v] = target.mesh.vertsPerFrame++;
+
+                    target.mesh.verts  .push_back(p);
+                    target.mesh.normals.push_back(n);
+                    target.mesh.tverts .push_back(v < (int)mesh.tverts.size() ? mesh.tverts[v] : noTVert);
+                    target.submeshes.back().numVertices++;
+                }
+
+                triangles[result].indices.push_back(vertexIndex[v]);
+            }
+
+            triangles[result].materials.push_back(material);
+            target.submeshes.back().numElements += 3;
+        }
+    }
+
+    for (size_t result = 0; result < merged.size(); result++)
+    {
+        DTSMesh& mesh(merged[result].mesh);
+
+        DTSPrimitive primitive;
+
+        primitive.firstElement = 0;
+        primitive.numElements  = 0;
+        primitive.type         = types[result];
+
+        mesh.primitives.assign(1, primitive);
+        DTSMeshTools::setTriangles(mesh, triangles[result]);
+
+        // Bounds of the merged vertices.
+        mesh.bounds.min = mesh.bounds.max = mesh.verts[0];
+
+        for (size_t v = 1; v < mesh.verts.size(); v++)
+        {
+            const Point& p(mesh.verts[v]);
+
+            mesh.bounds.min.x = std::min(mesh.bounds.min.x, p.x); mesh.bounds.max.x = std::max(mesh.bounds.max.x, p.x);
+            mesh.bounds.min.y = std::min(mesh.bounds.min.y, p.y); mesh.bounds.max.y = std::max(mesh.bounds.max.y, p.y);
+            mesh.bounds.min.z = std::min(mesh.bounds.min.z, p.z); mesh.bounds.max.z = std::max(mesh.bounds.max.z, p.z);
+        }
+
+        mesh.center.x = (mesh.bounds.min.x + mesh.bounds.max.x) * 0.5f;
+        mesh.center.y = (mesh.bounds.min.y + mesh.bounds.max.y) * 0.5f;
+        mesh.center.z = (mesh.bounds.min.z + mesh.bounds.max.z) * 0.5f;
+        mesh.radius   = 0;
+
+        for (size_t v = 0; v < mesh.verts.size(); v++)
+        {
+            float dx = mesh.verts[v].x - mesh.center.x, dy = mesh.verts[v].y - mesh.center.y, dz = mesh.verts[v].z - mesh.center.z;
+
+            mesh.radius = std::max(mesh.radius, sqrtf(dx * dx + dy * dy + dz * dz));
+        }
+    }
+}
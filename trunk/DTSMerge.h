@@ -0,0 +1,68 @@
+/*
+ * dts2fbx
+ * Copyright (c) 2011 Charlie Duhor. All rights reserved.
+ *
+ * @DTS2FBX_LICENSE_HEADER_START@
+ * 
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ * 
+ * @DTS2FBX_LICENSE_HEADER_START@
+ */
+
+#ifndef DTSConverter_DTSMerge_h
+#define DTSConverter_DTSMerge_h
+
+#include "DTSShape.h"
+
+#include <vector>
+
+class DTSSubmesh
+{
+public:
+    // Where the triangles of one source mesh landed in a merged mesh.
+    int object;
+    int mesh;
+    int firstElement;
+    int numElements;
+    int firstVertex;
+    int numVertices;
+};
+
+class DTSMergedMesh
+{
+public:
+    int     material;
+    int     node;       // Node the vertices are relative to, -1 when baked to the shape space
+    DTSMesh mesh;
+
+    std::vector<DTSSubmesh> submeshes;
+};
+
+class DTSMeshMerger
+{
+public:
+    // Objects whose meshes are all static, single frame standard meshes,
+    // and (unless merging by node) whose node is animated by no sequence of
+    // the shape or of the sequence files.
+    static void findMergeableObjects(const DTSShape& shape, const std::vector<DTSShape>& sequenceFiles, bool byNode, std::vector<bool>& mergeable);
+
+    // Merges the meshes drawn at a detail level by the mergeable objects into
+    // one mesh per material (and per node when byNode is set), in a single
+    // pass over their triangles. Node transforms are baked unless byNode.
+    static void merge(const DTSShape& shape, int detailLevel, const std::vector<bool>& mergeable, bool byNode, std::vector<DTSMergedMesh>& merged);
+};
+
+#endif
@@ -0,0 +1,110 @@
+/*
+ * dts2fbx
+ * Copyright (c) 2011 Charlie Duhor. All rights reserved.
+ *
+ * @DTS2FBX_LICENSE_HEADER_START@
+ * 
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ * 
+ * @DTS2FBX_LICENSE_HEADER_START@
+ */
+
+#ifndef DTSConverter_DTSMeshTools_h
+#define DTSConverter_DTSMeshTools_h
+
+#include "DTSShape.h"
+
+#include <stdint.h>
+#include <vector>
+
+class DTSNormalTable
+{
+public:
+    // The 256 entry encoded normal table, one array per component.
+    static const float x[256];
+    static const float y[256];
+    static const float z[256];
+};
+
+class DTSDecodedNormals
+{
+public:
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> z;
+};
+
+class DTSTriangles
+{
+public:
+    // Strips and fans expanded to a plain list, three indices per triangle,
+    // with the material (primitive.type & 0xffff) of every triangle.
+    std::vector<int> indices;
+    std::vector<int> materials;
+
+public:
+    int count() const { return (int)materials.size(); }
+};
+
+class DTSSkinCSR
+{
+public:
+    // Skin weights bucketed by bone (index into DTSMesh::nodeIndex): the
+    // influences of bone b are [offsets[b], offsets[b + 1]).
+    std::vector<int>   offsets;
+    std::vector<int>   vertices;
+    std::vector<float> weights;
+
+public:
+    void build(const DTSMesh& mesh);
+
+    int numBones() const { return offsets.empty() ? 0 : (int)offsets.size() - 1; }
+    int count(int bone) const { return offsets[bone + 1] - offsets[bone]; }
+};
+
+class DTSMeshTools
+{
+public:
+    // Primitives address the index list with signed shorts.
+    enum { MaxIndices = 32767 };
+
+    // Expands the first count normals of a mesh, using the encoded normals
+    // when present and the raw normals otherwise.
+    static void decodeNormals(const DTSMesh& mesh, int count, DTSDecodedNormals& normals);
+    static void decodeNormals(const unsigned char* encoded, int count, float* x, float* y, float* z);
+
+    static void expandTriangles(const DTSMesh& mesh, DTSTriangles& triangles);
+
+    // Replaces the primitives with one triangle list per run of equal
+    // materials, keeping the flags of the mesh's existing primitives.
+    // Returns false and leaves the mesh alone when there are more than
+    // MaxIndices indices.
+    static bool setTriangles(DTSMesh& mesh, const DTSTriangles& triangles);
+
+    // Merges vertices whose position, texture coordinate, normal and skin
+    // influences match within epsilon, and remaps the indices. Returns the
+    // number of vertices removed.
+    static int weldVertices(DTSMesh& mesh, float epsilon);
+
+    // 64-bit FNV-1a hash of the geometry, texture coordinates, normals,
+    // primitives and skin data; equal meshes hash equal.
+    static uint64_t contentHash(const DTSMesh& mesh);
+
+    // Exact comparison of everything contentHash covers.
+    static bool sameContent(const DTSMesh& a, const DTSMesh& b);
+};
+
+#endif
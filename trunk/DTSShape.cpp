@@ -26,11 +26,14 @@
 #include <stdio.h>
 #include <assert.h>
 #include <vector>
+#include <algorithm>
+#include <string.h>
 #include <sys/stat.h>
 
 #include "DTSTypes.h"
 #include "DTSBase.h"
 #include "DTSShape.h"
+#include "DTSMeshTools.h"
 
 DTSShape::DTSShape() :
     numNodes              (0),
@@ -60,7 +63,161 @@ DTSShape::DTSShape() :
 {
 }
 
-void DTSShape::loadShapeFile(FILE* file)
+DTSMesh::DTSMesh() :
+    type         (T_Null),
+    numFrames    (0),
+    matFrames    (0),
+    parent       (-1),
+    radius       (0),
+    vertsPerFrame(0),
+    flags        (0)
+{
+}
+
+void DTSMesh::swap(DTSMesh& other)
+{
+    std::swap(type,          other.type);
+    std::swap(numFrames,     other.numFrames);
+    std::swap(matFrames,     other.matFrames);
+    std::swap(parent,        other.parent);
+    std::swap(bounds,        other.bounds);
+    std::swap(center,        other.center);
+    std::swap(radius,        other.radius);
+    std::swap(vertsPerFrame, other.vertsPerFrame);
+    std::swap(flags,         other.flags);
+
+    verts        .swap(other.verts);
+    tverts       .swap(other.tverts);
+    normals      .swap(other.normals);
+    enormals     .swap(other.enormals);
+    primitives   .swap(other.primitives);
+    indices      .swap(other.indices);
+    mindices     .swap(other.mindices);
+    vindex       .swap(other.vindex);
+    vbone        .swap(other.vbone);
+    vweight      .swap(other.vweight);
+    nodeIndex    .swap(other.nodeIndex);
+    nodeTransform.swap(other.nodeTransform);
+    clusters     .swap(other.clusters);
+    startCluster .swap(other.startCluster);
+    firstVerts   .swap(other.firstVerts);
+    numVerts     .swap(other.numVerts);
+    firstTVerts  .swap(other.firstTVerts);
+}
+
+DTSDetailSelection::DTSDetailSelection() :
+    all    (false),
+    highest(false)
+{
+}
+
+bool DTSDetailSelection::parse(const char* value)
+{
+    std::string list(value);
+    size_t      start = 0;
+
+    while (start <= list.size())
+    {
+        size_t      end = list.find(',', start);
+        std::string item;
+
+        if (end == std::string::npos)
+        {
+            end = list.size();
+        }
+
+        item  = list.substr(start, end - start);
+        start = end + 1;
+
+        if (item.empty())
+        {
+            return false;
+        }
+
+        if (item == "all")
+        {
+            all = true;
+        }
+        else if (item == "highest")
+        {
+            highest = true;
+        }
+        else if (item.find_first_not_of("0123456789") == std::string::npos)
+        {
+            indexes.push_back(atoi(item.c_str()));
+        }
+        else
+        {
+            names.push_back(item);
+        }
+    }
+
+    return true;
+}
+
+void DTSDetailSelection::resolve(const DTSShape& shape, std::vector<bool>& selectedLevels) const
+{
+    int index, count = (int)shape.detailLevels.size();
+
+    selectedLevels.assign(count, all);
+
+    if (highest)
+    {
+        int best = -1;
+
+        for (index = 0; index < count; index++)
+        {
+            if (best == -1 || shape.detailLevels[index].size > shape.detailLevels[best].size)
+            {
+                best = index;
+            }
+        }
+
+        if (best != -1)
+        {
+            selectedLevels[best] = true;
+        }
+    }
+
+    std::vector<int>::const_iterator indexIt, indexEnd(indexes.end());
+
+    for (indexIt = indexes.begin(); indexIt != indexEnd; ++indexIt)
+    {
+        if (*indexIt < count)
+        {
+            selectedLevels[*indexIt] = true;
+        }
+        else
+        {
+            fprintf(stderr, "Warning: no detail level #%i\n", *indexIt);
+        }
+    }
+
+    std::vector<std::string>::const_iterator nameIt, nameEnd(names.end());
+
+    for (nameIt = names.begin(); nameIt != nameEnd; ++nameIt)
+    {
+        bool found = false;
+
+        for (index = 0; index < count; index++)
+        {
+            int name = shape.detailLevels[index].name;
+
+            if (name != -1 && shape.names[name] == *nameIt)
+            {
+                selectedLevels[index] = true;
+                found = true;
+            }
+        }
+
+        if (!found)
+        {
+            fprintf(stderr, "Warning: no detail level named %s\n", (*nameIt).c_str());
+        }
+    }
+}
+
+void DTSShape::loadShapeFile(FILE* file, const DTSDetailSelection* details)
 {
     DTSBase::load(file);
     Read(numNodes);
@@ -186,9 +343,10 @@ void DTSShape::loadShapeFile(FILE* file)
     
     // Animation translations and rotations
     
-    nodeTranslations.resize(numNodeTranslations);
-    nodeRotations   .resize(numNodeRotations);
-    Read(nodeTranslations);
+    std::vector<Point> translations(numNodeTranslations);
+
+    nodeRotations.resize(numNodeRotations);
+    Read(translations);
     Read(nodeRotations);
     ReadCheck(8);
     
@@ -245,8 +403,28 @@ void DTSShape::loadShapeFile(FILE* file)
     
     // Meshes
     
-    meshes.resize(numMeshes);
-    Read(meshes);
+    meshes    .resize(numMeshes);
+    meshLoaded.assign(numMeshes, details == NULL);
+
+    std::vector<DTSStreamPosition> meshPositions;
+
+    if (details)
+    {
+        // Which meshes are needed is only known once the names are read, so
+        // just remember where every mesh starts for now.
+        meshPositions.resize(numMeshes);
+
+        for (int m = 0; m < numMeshes; m++)
+        {
+            Tell(meshPositions[m]);
+            SkipMesh();
+        }
+    }
+    else
+    {
+        Read(meshes);
+    }
+
     ReadCheck();
 
     // Names
@@ -254,9 +432,31 @@ void DTSShape::loadShapeFile(FILE* file)
     names.resize(numNames);
     Read(names);
     ReadCheck();
-    
+
+    if (details)
+    {
+        std::vector<bool> selectedLevels;
+        DTSStreamPosition end;
+
+        details->resolve(*this, selectedLevels);
+        meshesForDetailLevels(selectedLevels, meshLoaded);
+        Tell(end);
+
+        for (int m = 0; m < numMeshes; m++)
+        {
+            if (meshLoaded[m])
+            {
+                Seek(meshPositions[m]);
+                Read(meshes[m]);
+            }
+        }
+
+        Seek(end);
+    }
+
     // Sequences
     loadSequences(file, false);
+    quantizeTranslations(translations);
 
     // Materials
 
@@ -333,6 +533,233 @@ void DTSShape::loadSequences(FILE* file, bool dsq)
         ReadRawTyped(file, p.matters.vis);
         ReadRawTyped(file, p.matters.frame);
         ReadRawTyped(file, p.matters.matframe);
+
+        p.buildKeyIndex();
+    }
+}
+
+static void prefixKeys(const std::vector<bool>& matters, int base, int numKeyFrames, std::vector<int>& keys)
+{
+    keys.resize(matters.size());
+
+    for (size_t node = 0; node < matters.size(); node++)
+    {
+        if (matters[node])
+        {
+            keys[node] = base;
+            base      += numKeyFrames;
+        }
+        else
+        {
+            keys[node] = -1;
+        }
+    }
+}
+
+void DTSSequence::buildKeyIndex()
+{
+    prefixKeys(matters.rotation,    baseRotation,    numKeyFrames, rotationKeys);
+    prefixKeys(matters.translation, baseTranslation, numKeyFrames, translationKeys);
+}
+
+int DTSSequence::rotationKey(int node, int frame) const
+{
+    int first = (node < (int)rotationKeys.size()) ? rotationKeys[node] : -1;
+
+    return (first < 0) ? -1 : first + frame;
+}
+
+int DTSSequence::translationKey(int node, int frame) const
+{
+    int first = (node < (int)translationKeys.size()) ? translationKeys[node] : -1;
+
+    return (first < 0) ? -1 : first + frame;
+}
+
+void DTSSequence::keysAt(float time, int& key0, int& key1, float& blend) const
+{
+    key0  = key1 = 0;
+    blend = 0;
+
+    if (numKeyFrames <= 0 || duration <= 0)
+    {
+        return;
+    }
+
+    float position = time / duration * numKeyFrames;
+
+    if (position < 0)
+    {
+        position = 0;
+    }
+
+    key0  = (int)position;
+    blend = position - key0;
+
+    if (flags & F_Cyclic)
+    {
+        key0 %= numKeyFrames;
+        key1  = (key0 + 1) % numKeyFrames;
+    }
+    else if (key0 >= numKeyFrames - 1)
+    {
+        key0  = key1 = numKeyFrames - 1;
+        blend = 0;
+    }
+    else
+    {
+        key1 = key0 + 1;
+    }
+}
+
+void DTSShape::quantizeTranslations(const std::vector<Point>& translations)
+{
+    int numKeys = (int)translations.size();
+
+    // Every track starts and ends a run, so no range spans two tracks.
+    std::vector<int> starts(1, 0);
+
+    std::vector<DTSSequence>::const_iterator seqIt, seqEnd(sequences.end());
+
+    for (seqIt = sequences.begin(); seqIt != seqEnd; ++seqIt)
+    {
+        std::vector<int>::const_iterator it, end((*seqIt).translationKeys.end());
+
+        for (it = (*seqIt).translationKeys.begin(); it != end; ++it)
+        {
+            if (*it > 0 && *it < numKeys)
+            {
+                starts.push_back(*it);
+            }
+
+            if (*it >= 0 && *it + (*seqIt).numKeyFrames < numKeys)
+            {
+                starts.push_back(*it + (*seqIt).numKeyFrames);
+            }
+        }
+    }
+
+    std::sort(starts.begin(), starts.end());
+    starts.erase(std::unique(starts.begin(), starts.end()), starts.end());
+
+    nodeTranslations .resize(numKeys);
+    translationRanges.clear();
+
+    for (size_t run = 0; run < starts.size() && starts[run] < numKeys; run++)
+    {
+        int first = starts[run];
+        int last  = (run + 1 < starts.size()) ? starts[run + 1] : numKeys;
+        int key;
+
+        Point min(translations[first]);
+        Point max(translations[first]);
+
+        for (key = first + 1; key < last; key++)
+        {
+            const Point& p(translations[key]);
+
+            min.x = std::min(min.x, p.x); max.x = std::max(max.x, p.x);
+            min.y = std::min(min.y, p.y); max.y = std::max(max.y, p.y);
+            min.z = std::min(min.z, p.z); max.z = std::max(max.z, p.z);
+        }
+
+        DTSKeyRange range;
+
+        range.firstKey = first;
+        range.min      = min;
+        range.scale.x  = (max.x - min.x) / 65535.0f;
+        range.scale.y  = (max.y - min.y) / 65535.0f;
+        range.scale.z  = (max.z - min.z) / 65535.0f;
+
+        translationRanges.push_back(range);
+
+        for (key = first; key < last; key++)
+        {
+            const Point& p(translations[key]);
+            Point16&     q(nodeTranslations[key]);
+
+            q.x = (range.scale.x > 0) ? (unsigned short)((p.x - min.x) / range.scale.x + 0.5f) : 0;
+            q.y = (range.scale.y > 0) ? (unsigned short)((p.y - min.y) / range.scale.y + 0.5f) : 0;
+            q.z = (range.scale.z > 0) ? (unsigned short)((p.z - min.z) / range.scale.z + 0.5f) : 0;
+        }
+    }
+}
+
+Quaternion DTSShape::nodeRotation(int key) const
+{
+    const Quat16& q(nodeRotations[key]);
+    Quaternion    r;
+
+    r.x = q.x / 32767.0f;
+    r.y = q.y / 32767.0f;
+    r.z = q.z / 32767.0f;
+    r.w = q.w / 32767.0f;
+    return r;
+}
+
+Point DTSShape::nodeTranslation(int key) const
+{
+    Point p;
+
+    decodeTranslations(key, 1, &p);
+    return p;
+}
+
+void DTSShape::decodeRotations(int firstKey, int count, Quaternion* rotations) const
+{
+    for (int index = 0; index < count; index++)
+    {
+        rotations[index] = nodeRotation(firstKey + index);
+    }
+}
+
+void DTSShape::decodeTranslations(int firstKey, int count, Point* translations) const
+{
+    // Last range starting at or before firstKey.
+    int low = 0, high = (int)translationRanges.size();
+
+    while (high - low > 1)
+    {
+        int middle = (low + high) / 2;
+
+        if (translationRanges[middle].firstKey <= firstKey)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    for (int index = 0; index < count; index++)
+    {
+        int key = firstKey + index;
+
+        while (low + 1 < (int)translationRanges.size() && translationRanges[low + 1].firstKey <= key)
+        {
+            low++;
+        }
+
+        const DTSKeyRange& range(translationRanges[low]);
+        const Point16&     q(nodeTranslations[key]);
+
+        translations[index].x = range.min.x + q.x * range.scale.x;
+        translations[index].y = range.min.y + q.y * range.scale.y;
+        translations[index].z = range.min.z + q.z * range.scale.z;
+    }
+}
+
+void DTSShape::hashMeshes()
+{
+    int count = (int)meshes.size();
+
+    meshHashes.assign(count, 0);
+
+#pragma omp parallel for schedule(dynamic)
+    for (int mesh = 0; mesh < count; mesh++)
+    {
+        meshHashes[mesh] = DTSMeshTools::contentHash(meshes[mesh]);
     }
 }
 
@@ -357,25 +784,25 @@ void DTSShape::loadSequenceFile(FILE* file, const DTSShape* baseShape)
     
     for (index = 0; index < nodeRotations.size(); index++)
     {
-        Quaternion q;
+        Quat16 q;
         
-        q.x = (float)ReadRawTyped<short>(file) / 32767.0f;
-        q.y = (float)ReadRawTyped<short>(file) / 32767.0f;
-        q.z = (float)ReadRawTyped<short>(file) / 32767.0f;
-        q.w = (float)ReadRawTyped<short>(file) / 32767.0f;
+        q.x = ReadRawTyped<short>(file);
+        q.y = ReadRawTyped<short>(file);
+        q.z = ReadRawTyped<short>(file);
+        q.w = ReadRawTyped<short>(file);
         nodeRotations[index] = q;
     }
     
-    nodeTranslations.resize(numNodeTranslations = ReadRawTyped<int>(file));
+    std::vector<Point> translations(numNodeTranslations = ReadRawTyped<int>(file));
     
-    for (index = 0; index < nodeTranslations.size(); index++)
+    for (index = 0; index < translations.size(); index++)
     {
         Point p;
         
         p.x = ReadRawTyped<float>(file);
         p.y = ReadRawTyped<float>(file);
         p.z = ReadRawTyped<float>(file);
-        nodeTranslations[index] = p;
+        translations[index] = p;
     }
     
     nodeScalesUniform.resize(numNodeScalesUniform = ReadRawTyped<int>(file));
@@ -448,6 +875,7 @@ void DTSShape::loadSequenceFile(FILE* file, const DTSShape* baseShape)
     ReadRawTyped<int>(file);
     
     loadSequences(file, true);
+    quantizeTranslations(translations);
     
     triggers.resize(numTriggers = ReadRawTyped<int>(file));
     
@@ -530,6 +958,102 @@ bool DTSShape::nodeIsLinkedToObject(int node) const
     return false;
 }
 
+void DTSShape::meshesForDetailLevels(const std::vector<bool>& selectedLevels, std::vector<bool>& selectedMeshes) const
+{
+    selectedMeshes.assign(meshes.size(), false);
+
+    for (size_t level = 0; level < detailLevels.size(); level++)
+    {
+        const DTSDetailLevel& detail(detailLevels[level]);
+
+        if (!selectedLevels[level] || detail.subshape < 0 || detail.subshape >= (int)subshapes.size())
+        {
+            continue;
+        }
+
+        const DTSSubshape& subshape(subshapes[detail.subshape]);
+
+        for (int index = subshape.firstObject; index < (subshape.firstObject + subshape.numObjects); index++)
+        {
+            const DTSObject& object(objects[index]);
+
+            if (detail.objectDetail >= 0 && detail.objectDetail < object.numMeshes)
+            {
+                selectedMeshes[object.firstMesh + detail.objectDetail] = true;
+            }
+        }
+    }
+}
+
+void DTSShape::objectLods(const DTSObject& object, float screenHeight, std::vector<DTSLodLevel>& levels) const
+{
+    int objectIndex = (int)(&object - &objects[0]);
+
+    levels.clear();
+
+    for (size_t level = 0; level < detailLevels.size(); level++)
+    {
+        const DTSDetailLevel& detail(detailLevels[level]);
+
+        if (detail.subshape < 0 || detail.subshape >= (int)subshapes.size())
+        {
+            continue;
+        }
+
+        const DTSSubshape& subshape(subshapes[detail.subshape]);
+
+        if (objectIndex < subshape.firstObject || objectIndex >= (subshape.firstObject + subshape.numObjects))
+        {
+            continue;
+        }
+
+        DTSLodLevel lod;
+
+        lod.detailLevel = (int)level;
+        lod.mesh        = -1;
+        lod.size        = detail.size;
+
+        // Negative sizes are never drawn (collision and hidden levels).
+        if (lod.size < 0)
+        {
+            continue;
+        }
+
+        // Levels without a size (generated ones) switch when their maximum
+        // error would cover about a pixel.
+        if (lod.size == 0 && detail.maxError > 0)
+        {
+            lod.size = 2.0f * radius / detail.maxError;
+        }
+
+        if (detail.objectDetail >= 0 && detail.objectDetail < object.numMeshes)
+        {
+            int mesh = object.firstMesh + detail.objectDetail;
+
+            if (!meshLoaded[mesh])
+            {
+                continue;
+            }
+
+            if (meshes[mesh].type != DTSMesh::T_Null && meshes[mesh].vertsPerFrame > 0)
+            {
+                lod.mesh = mesh;
+            }
+        }
+
+        lod.coverage = lod.size / screenHeight;
+
+        std::vector<DTSLodLevel>::iterator it = levels.begin();
+
+        while (it != levels.end() && (*it).size >= lod.size)
+        {
+            ++it;
+        }
+
+        levels.insert(it, lod);
+    }
+}
+
 #ifdef WIN32
 #define PATHSEP "\\"
 #else
@@ -27,6 +27,7 @@
 
 #include "DTSBase.h"
 
+#include <stdint.h>
 #include <string>
 
 class DTSNode
@@ -146,6 +147,12 @@ public:
         T_Null     = 4
     };
     
+public:
+    DTSMesh();
+
+    // Exchanges contents without copying the vertex data.
+    void swap(DTSMesh& other);
+
 public:
     int   type;
     int   numFrames;
@@ -184,6 +191,12 @@ public:
 
 class DTSSequence
 {
+public:
+    enum
+    {
+        F_Cyclic = 1 << 4
+    };
+
 public:
     std::string name;
     int   nameIndex;
@@ -212,6 +225,24 @@ public:
         std::vector<bool> frame;
         std::vector<bool> matframe;
     } matters;
+
+    // Index of the first key of every node in nodeRotations/nodeTranslations,
+    // -1 for nodes the sequence does not animate. Rebuilt by buildKeyIndex()
+    // from the matters bits.
+    std::vector<int> rotationKeys;
+    std::vector<int> translationKeys;
+
+public:
+    void buildKeyIndex();
+
+    // Index of a node's key at the given frame, or -1.
+    int rotationKey   (int node, int frame) const;
+    int translationKey(int node, int frame) const;
+
+    // Keys surrounding a time in seconds, key k being at k * duration /
+    // numKeyFrames. Cyclic sequences wrap from the last key back to the
+    // first, others hold the last key.
+    void keysAt(float time, int& key0, int& key1, float& blend) const;
 };
 
 class DTSMaterial
@@ -237,6 +268,43 @@ public:
     std::string resolve(const std::string&) const;
 };
 
+class DTSShape;
+
+class DTSLodLevel
+{
+public:
+    int   detailLevel;
+    int   mesh;      // -1 when the object is not drawn at this level
+    float size;      // Projected size in pixels from which the level is used
+    float coverage;  // Same, as a fraction of the screen height
+};
+
+class DTSDetailSelection
+{
+public:
+    bool                     all;
+    bool                     highest;
+    std::vector<int>         indexes;
+    std::vector<std::string> names;
+
+public:
+    DTSDetailSelection();
+
+    // Parses a comma separated list of detail level indexes, names, "all" or "highest".
+    bool parse(const char* value);
+
+    void resolve(const DTSShape& shape, std::vector<bool>& selectedLevels) const;
+};
+
+// Quantization range of a run of translation keys: key = min + q * scale.
+class DTSKeyRange
+{
+public:
+    int   firstKey;
+    Point min;
+    Point scale;
+};
+
 class DTSShape : public DTSBase
 {
 public:
@@ -275,8 +343,9 @@ public:
 
     std::vector<Quaternion>   nodeDefRotations;
     std::vector<Point>        nodeDefTranslations;
-    std::vector<Quaternion>   nodeRotations;
-    std::vector<Point>        nodeTranslations;
+    std::vector<Quat16>       nodeRotations;       // Decoded by nodeRotation()
+    std::vector<Point16>      nodeTranslations;    // Decoded by nodeTranslation()
+    std::vector<DTSKeyRange>  translationRanges;   // Sorted by firstKey, covering nodeTranslations
     std::vector<float>        nodeScalesUniform;
     std::vector<Point>        nodeScalesAligned;
     std::vector<Point>        nodeScalesArbitrary;
@@ -292,13 +361,27 @@ public:
     std::vector<DTSSequence>    sequences;
     std::vector<std::string>    names;
     std::vector<DTSMaterial>    materials;
+
+    // False for meshes left undecoded by a detail level selection.
+    std::vector<bool> meshLoaded;
+
+    // DTSMeshTools::contentHash of every mesh, empty until hashMeshes().
+    std::vector<uint64_t> meshHashes;
     
 public:
     DTSShape();
 
-    void loadShapeFile(FILE*);
+    void loadShapeFile(FILE*, const DTSDetailSelection* details = NULL);
+
+    // Fills meshHashes, in parallel; call it after the last pass
+    // that modifies meshes.
+    void hashMeshes();
     void loadSequenceFile(FILE*, const DTSShape* baseShape);
     void loadSequences(FILE*, bool dsq);
+
+    // Fills nodeTranslations and translationRanges, one range per key run
+    // of every sequence track. Needs the sequences.
+    void quantizeTranslations(const std::vector<Point>& translations);
     
     std::string nodeNameAtIndex  (int) const;
     std::string objectNameAtIndex(int) const;
@@ -306,7 +389,20 @@ public:
     
     int findNode(const char* nodeName) const;
 
+    // Animation keys are kept quantized and decoded on access.
+    Quaternion nodeRotation   (int key) const;
+    Point      nodeTranslation(int key) const;
+
+    void decodeRotations   (int firstKey, int count, Quaternion* rotations)    const;
+    void decodeTranslations(int firstKey, int count, Point*      translations) const;
+
     bool nodeIsLinkedToObject(int node) const;
+
+    // Meshes drawn by the given detail levels (DTSObject::firstMesh + objectDetail).
+    void meshesForDetailLevels(const std::vector<bool>& selectedLevels, std::vector<bool>& selectedMeshes) const;
+
+    // Visible detail levels of an object, from the most to the least detailed.
+    void objectLods(const DTSObject& object, float screenHeight, std::vector<DTSLodLevel>& levels) const;
 };
 
 #endif
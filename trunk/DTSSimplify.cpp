@@ -0,0 +1,988 @@
+/*
+ * dts2fbx
+ * Copyright (c) 2011 Charlie Duhor. All rights reserved.
+ *
+ * @DTS2FBX_LICENSE_HEADER_START@
+ * 
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ * 
+ * @DTS2FBX_LICENSE_HEADER_START@
+ */
+
+#include "DTSSimplify.h"
+#include "DTSMeshTools.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include <functional>
+#include <queue>
+
+static const float SkinTolerance = 0.25f;  // Largest sum of weight differences between merged vertices
+static const float FlipThreshold = 0.2f;   // Smallest cosine between a face normal before and after a collapse
+
+static inline Point sub(const Point& a, const Point& b)
+{
+    Point r;
+
+    r.x = a.x - b.x; r.y = a.y - b.y; r.z = a.z - b.z;
+    return r;
+}
+
+static inline Point cross(const Point& a, const Point& b)
+{
+    Point r;
+
+    r.x = a.y * b.z - a.z * b.y;
+    r.y = a.z * b.x - a.x * b.z;
+    r.z = a.x * b.y - a.y * b.x;
+    return r;
+}
+
+static inline float dot(const Point& a, const Point& b)
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+static float distanceToTriangle(const Point& p, const Point& a, const Point& b, const Point& c)
+{
+    // Closest point on the triangle, by Voronoi region.
+    Point ab = sub(b, a), ac = sub(c, a), ap = sub(p, a);
+    Point closest;
+
+    float d1 = dot(ab, ap), d2 = dot(ac, ap);
+
+    if (d1 <= 0 && d2 <= 0)
+    {
+        closest = a;
+    }
+    else
+    {
+        Point bp = sub(p, b), cp = sub(p, c);
+
+        float d3 = dot(ab, bp), d4 = dot(ac, bp);
+        float d5 = dot(ab, cp), d6 = dot(ac, cp);
+        float vc = d1 * d4 - d3 * d2;
+        float vb = d5 * d2 - d1 * d6;
+        float va = d3 * d6 - d5 * d4;
+
+        if (d3 >= 0 && d4 <= d3)
+        {
+            closest = b;
+        }
+        else if (d6 >= 0 && d5 <= d6)
+        {
+            closest = c;
+        }
+        else if (vc <= 0 && d1 >= 0 && d3 <= 0)
+        {
+            float v = d1 / (d1 - d3);
+
+            closest.x = a.x + ab.x * v; closest.y = a.y + ab.y * v; closest.z = a.z + ab.z * v;
+        }
+        else if (vb <= 0 && d2 >= 0 && d6 <= 0)
+        {
+            float w = d2 / (d2 - d6);
+
+            closest.x = a.x + ac.x * w; closest.y = a.y + ac.y * w; closest.z = a.z + ac.z * w;
+        }
+        else if (va <= 0 && (d4 - d3) >= 0 && (d5 - d6) >= 0)
+        {
+            float w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+
+            closest.x = b.x + (c.x - b.x) * w; closest.y = b.y + (c.y - b.y) * w; closest.z = b.z + (c.z - b.z) * w;
+        }
+        else
+        {
+            float denom = 1.0f / (va + vb + vc);
+            float v     = vb * denom;
+            float w     = vc * denom;
+
+            closest.x = a.x + ab.x * v + ac.x * w;
+            closest.y = a.y + ab.y * v + ac.y * w;
+            closest.z = a.z + ab.z * v + ac.z * w;
+        }
+    }
+
+    Point d = sub(p, closest);
+
+    return sqrtf(dot(d, d));
+}
+
+class Quadric
+{
+public:
+    double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+
+public:
+    Quadric() : a2(0), ab(0), ac(0), ad(0), b2(0), bc(0), bd(0), c2(0), cd(0), d2(0)
+    {
+    }
+
+    void addPlane(double a, double b, double c, double d, double weight)
+    {
+        a2 += weight * a * a; ab += weight * a * b; ac += weight * a * c; ad += weight * a * d;
+        b2 += weight * b * b; bc += weight * b * c; bd += weight * b * d;
+        c2 += weight * c * c; cd += weight * c * d;
+        d2 += weight * d * d;
+    }
+
+    void add(const Quadric& q)
+    {
+        a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad;
+        b2 += q.b2; bc += q.bc; bd += q.bd;
+        c2 += q.c2; cd += q.cd;
+        d2 += q.d2;
+    }
+
+    double evaluate(const Point& p) const
+    {
+        double x = p.x, y = p.y, z = p.z;
+
+        return a2 * x * x + 2 * ab * x * y + 2 * ac * x * z + 2 * ad * x
+             + b2 * y * y + 2 * bc * y * z + 2 * bd * y
+             + c2 * z * z + 2 * cd * z
+             + d2;
+    }
+};
+
+class Collapse
+{
+public:
+    float cost;
+    int   from;
+    int   to;
+    int   fromVersion;
+    int   toVersion;
+
+    // Reversed so that std::priority_queue pops the cheapest collapse.
+    bool operator<(const Collapse& other) const { return cost > other.cost; }
+};
+
+// Half-edge style corner table: corner c is the vertex cornerVertex[c] of
+// triangle c / 3, and all corners of a vertex are chained from firstCorner
+// through nextCorner. Collapsing u into v relabels u's corners and splices
+// its chain into v's, so no adjacency is ever rebuilt.
+class Simplification
+{
+public:
+    const DTSMesh& mesh;
+    int            numVertices;
+    int            numTriangles;
+    int            aliveTriangles;
+
+    std::vector<int>  cornerVertex;
+    std::vector<int>  firstCorner;
+    std::vector<int>  nextCorner;
+    std::vector<bool> deadTriangle;
+    std::vector<int>  materials;
+
+    std::vector<Quadric> quadrics;
+    std::vector<bool>    locked;
+    std::vector<bool>    removed;
+    std::vector<int>     collapsedInto;
+    std::vector<int>     version;
+
+    std::vector<int>   influenceStart;
+    std::vector<int>   influenceBone;
+    std::vector<float> influenceWeight;
+
+    std::priority_queue<Collapse> queue;
+
+public:
+    Simplification(const DTSMesh& source) : mesh(source)
+    {
+    }
+
+    const Point& position(int vertex) const { return mesh.verts[vertex]; }
+
+    void build(const DTSTriangles& triangles);
+    void lockBoundaries();
+    void buildInfluences();
+    bool compatibleSkin(int u, int v) const;
+    void push(int from, int to);
+    bool collapse(const Collapse& c);
+    void run(int targetTriangles);
+    int  representative(int vertex);
+    void measure(float& avgError, float& maxError);
+    bool output(DTSMesh& result);
+};
+
+void Simplification::build(const DTSTriangles& triangles)
+{
+    numVertices  = mesh.vertsPerFrame;
+    numTriangles = 0;
+
+    cornerVertex.reserve(triangles.indices.size());
+    materials   .reserve(triangles.materials.size());
+
+    // Strips carry degenerate triangles, drop them here.
+    for (int t = 0; t < triangles.count(); t++)
+    {
+        int a = triangles.indices[t * 3], b = triangles.indices[t * 3 + 1], c = triangles.indices[t * 3 + 2];
+
+        if (a == b || b == c || a == c)
+        {
+            continue;
+        }
+
+        cornerVertex.push_back(a);
+        cornerVertex.push_back(b);
+        cornerVertex.push_back(c);
+        materials   .push_back(triangles.materials[t]);
+        numTriangles++;
+    }
+
+    aliveTriangles = numTriangles;
+
+    firstCorner  .assign(numVertices, -1);
+    nextCorner   .assign(numTriangles * 3, -1);
+    deadTriangle .assign(numTriangles, false);
+    quadrics     .assign(numVertices, Quadric());
+    locked       .assign(numVertices, false);
+    removed      .assign(numVertices, false);
+    collapsedInto.assign(numVertices, -1);
+    version      .assign(numVertices, 0);
+
+    for (int c = numTriangles * 3 - 1; c >= 0; c--)
+    {
+        nextCorner[c]                = firstCorner[cornerVertex[c]];
+        firstCorner[cornerVertex[c]] = c;
+    }
+
+    // Area weighted plane quadrics.
+    for (int t = 0; t < numTriangles; t++)
+    {
+        const Point& p0(position(cornerVertex[t * 3]));
+        const Point& p1(position(cornerVertex[t * 3 + 1]));
+        const Point& p2(position(cornerVertex[t * 3 + 2]));
+
+        Point  n      = cross(sub(p1, p0), sub(p2, p0));
+        double length = sqrt((double)dot(n, n));
+
+        if (length <= 0)
+        {
+            continue;
+        }
+
+        double a = n.x / length, b = n.y / length, c = n.z / length;
+        double d = -(a * p0.x + b * p0.y + c * p0.z);
+
+        for (int corner = 0; corner < 3; corner++)
+        {
+            quadrics[cornerVertex[t * 3 + corner]].addPlane(a, b, c, d, length * 0.5);
+        }
+    }
+}
+
+class PositionLess
+{
+public:
+    const std::vector<Point>& verts;
+
+    PositionLess(const std::vector<Point>& v) : verts(v) {}
+
+    bool operator()(int a, int b) const
+    {
+        const Point& pa(verts[a]);
+        const Point& pb(verts[b]);
+
+        if (pa.x != pb.x) return pa.x < pb.x;
+        if (pa.y != pb.y) return pa.y < pb.y;
+        return pa.z < pb.z;
+    }
+};
+
+void Simplification::lockBoundaries()
+{
+    int v, t;
+
+    // UV seams and hard edges: several vertices at the same position.
+    std::vector<int> order(numVertices);
+
+    for (v = 0; v < numVertices; v++)
+    {
+        order[v] = v;
+    }
+
+    std::sort(order.begin(), order.end(), PositionLess(mesh.verts));
+
+    for (v = 1; v < numVertices; v++)
+    {
+        const Point& a(position(order[v - 1]));
+        const Point& b(position(order[v]));
+
+        if (a.x == b.x && a.y == b.y && a.z == b.z)
+        {
+            locked[order[v - 1]] = true;
+            locked[order[v]]     = true;
+        }
+    }
+
+    // Material boundaries.
+    std::vector<int> vertexMaterial(numVertices, -1);
+
+    for (t = 0; t < numTriangles; t++)
+    {
+        for (int corner = 0; corner < 3; corner++)
+        {
+            int vertex = cornerVertex[t * 3 + corner];
+
+            if (vertexMaterial[vertex] == -1)
+            {
+                vertexMaterial[vertex] = materials[t];
+            }
+            else if (vertexMaterial[vertex] != materials[t])
+            {
+                locked[vertex] = true;
+            }
+        }
+    }
+
+    // Open boundaries: edges used by a single triangle.
+    std::vector<std::pair<int,int> > edges;
+
+    edges.reserve(numTriangles * 3);
+
+    for (t = 0; t < numTriangles; t++)
+    {
+        for (int corner = 0; corner < 3; corner++)
+        {
+            int a = cornerVertex[t * 3 + corner];
+            int b = cornerVertex[t * 3 + (corner + 1) % 3];
+
+            edges.push_back(std::pair<int,int>(std::min(a, b), std::max(a, b)));
+        }
+    }
+
+    std::sort(edges.begin(), edges.end());
+
+    for (size_t e = 0; e < edges.size(); )
+    {
+        size_t end = e + 1;
+
+        while (end < edges.size() && edges[end] == edges[e])
+        {
+            end++;
+        }
+
+        if (end - e == 1)
+        {
+            locked[edges[e].first]  = true;
+            locked[edges[e].second] = true;
+        }
+
+        e = end;
+    }
+}
+
+void Simplification::buildInfluences()
+{
+    int numWeights = (int)mesh.vindex.size();
+    int index;
+
+    influenceStart.assign(numVertices + 1, 0);
+
+    if (mesh.type != DTSMesh::T_Skin)
+    {
+        return;
+    }
+
+    for (index = 0; index < numWeights; index++)
+    {
+        if (mesh.vindex[index] < numVertices)
+        {
+            influenceStart[mesh.vindex[index] + 1]++;
+        }
+    }
+
+    for (index = 0; index < numVertices; index++)
+    {
+        influenceStart[index + 1] += influenceStart[index];
+    }
+
+    std::vector<int> cursor(influenceStart.begin(), influenceStart.end() - 1);
+
+    influenceBone  .resize(influenceStart[numVertices]);
+    influenceWeight.resize(influenceStart[numVertices]);
+
+    for (index = 0; index < numWeights; index++)
+    {
+        if (mesh.vindex[index] < numVertices)
+        {
+            int slot = cursor[mesh.vindex[index]]++;
+
+            influenceBone  [slot] = mesh.vbone  [index];
+            influenceWeight[slot] = mesh.vweight[index];
+        }
+    }
+}
+
+bool Simplification::compatibleSkin(int u, int v) const
+{
+    if (mesh.type != DTSMesh::T_Skin)
+    {
+        return true;
+    }
+
+    float difference = 0;
+    int   i, j;
+
+    // Influence lists are short, compare them pairwise.
+    for (i = influenceStart[u]; i < influenceStart[u + 1]; i++)
+    {
+        float other = 0;
+
+        for (j = influenceStart[v]; j < influenceStart[v + 1]; j++)
+        {
+            if (influenceBone[j] == influenceBone[i])
+            {
+                other += influenceWeight[j];
+            }
+        }
+
+        difference += fabsf(influenceWeight[i] - other);
+    }
+
+    for (j = influenceStart[v]; j < influenceStart[v + 1]; j++)
+    {
+        bool shared = false;
+
+        for (i = influenceStart[u]; i < influenceStart[u + 1]; i++)
+        {
+            shared = shared || (influenceBone[i] == influenceBone[j]);
+        }
+
+        if (!shared)
+        {
+            difference += influenceWeight[j];
+        }
+    }
+
+    return difference <= SkinTolerance;
+}
+
+void Simplification::push(int from, int to)
+{
+    if (locked[from] || !compatibleSkin(from, to))
+    {
+        return;
+    }
+
+    Quadric q(quadrics[from]);
+
+    q.add(quadrics[to]);
+
+    Collapse c;
+
+    c.cost        = (float)q.evaluate(position(to));
+    c.from        = from;
+    c.to          = to;
+    c.fromVersion = version[from];
+    c.toVersion   = version[to];
+    queue.push(c);
+}
+
+bool Simplification::collapse(const Collapse& e)
+{
+    int u = e.from, v = e.to, c;
+
+    if (removed[u] || removed[v] || version[u] != e.fromVersion || version[v] != e.toVersion)
+    {
+        return false;
+    }
+
+    // Reject collapses flipping or squashing a remaining face.
+    for (c = firstCorner[u]; c != -1; c = nextCorner[c])
+    {
+        int t = c / 3;
+
+        if (deadTriangle[t])
+        {
+            continue;
+        }
+
+        int a = cornerVertex[t * 3], b = cornerVertex[t * 3 + 1], d = cornerVertex[t * 3 + 2];
+
+        if (a == v || b == v || d == v)
+        {
+            continue;
+        }
+
+        Point p[3] = { position(a), position(b), position(d) };
+        Point n0   = cross(sub(p[1], p[0]), sub(p[2], p[0]));
+
+        p[c % 3] = position(v);
+
+        Point n1 = cross(sub(p[1], p[0]), sub(p[2], p[0]));
+        float l  = sqrtf(dot(n0, n0) * dot(n1, n1));
+
+        if (l <= 0 || dot(n0, n1) < FlipThreshold * l)
+        {
+            return false;
+        }
+    }
+
+    int last = -1;
+
+    for (c = firstCorner[u]; c != -1; c = nextCorner[c])
+    {
+        int t = c / 3;
+
+        last = c;
+
+        if (deadTriangle[t])
+        {
+            continue;
+        }
+
+        if (cornerVertex[t * 3] == v || cornerVertex[t * 3 + 1] == v || cornerVertex[t * 3 + 2] == v)
+        {
+            deadTriangle[t] = true;
+            aliveTriangles--;
+        }
+        else
+        {
+            cornerVertex[c] = v;
+        }
+    }
+
+    if (last != -1)
+    {
+        nextCorner[last] = firstCorner[v];
+        firstCorner[v]   = firstCorner[u];
+        firstCorner[u]   = -1;
+    }
+
+    quadrics[v].add(quadrics[u]);
+    removed[u]       = true;
+    collapsedInto[u] = v;
+    version[v]++;
+
+    for (c = firstCorner[v]; c != -1; c = nextCorner[c])
+    {
+        int t = c / 3;
+
+        if (deadTriangle[t])
+        {
+            continue;
+        }
+
+        for (int corner = 1; corner < 3; corner++)
+        {
+            int w = cornerVertex[t * 3 + (c % 3 + corner) % 3];
+
+            push(w, v);
+            push(v, w);
+        }
+    }
+
+    return true;
+}
+
+void Simplification::run(int targetTriangles)
+{
+    for (int t = 0; t < numTriangles; t++)
+    {
+        for (int corner = 0; corner < 3; corner++)
+        {
+            int a = cornerVertex[t * 3 + corner];
+            int b = cornerVertex[t * 3 + (corner + 1) % 3];
+
+            push(a, b);
+            push(b, a);
+        }
+    }
+
+    while (aliveTriangles > targetTriangles && !queue.empty())
+    {
+        Collapse c = queue.top();
+
+        queue.pop();
+        collapse(c);
+    }
+}
+
+int Simplification::representative(int vertex)
+{
+    int root = vertex;
+
+    while (collapsedInto[root] != -1)
+    {
+        root = collapsedInto[root];
+    }
+
+    while (collapsedInto[vertex] != -1)
+    {
+        int next = collapsedInto[vertex];
+
+        collapsedInto[vertex] = root;
+        vertex = next;
+    }
+
+    return root;
+}
+
+void Simplification::measure(float& avgError, float& maxError)
+{
+    double sum   = 0;
+    int    count = 0;
+
+    maxError = 0;
+
+    for (int v = 0; v < numVertices; v++)
+    {
+        if (firstCorner[v] == -1 && !removed[v])
+        {
+            // Never referenced by a triangle.
+            continue;
+        }
+
+        float error = 0;
+
+        if (removed[v])
+        {
+            int r = representative(v);
+
+            error = sqrtf(dot(sub(position(v), position(r)), sub(position(v), position(r))));
+
+            for (int c = firstCorner[r]; c != -1; c = nextCorner[c])
+            {
+                int t = c / 3;
+
+                if (!deadTriangle[t])
+                {
+                    float d = distanceToTriangle(position(v), position(cornerVertex[t * 3]), position(cornerVertex[t * 3 + 1]), position(cornerVertex[t * 3 + 2]));
+
+                    error = std::min(error, d);
+                }
+            }
+        }
+
+        sum += error;
+        count++;
+
+        maxError = std::max(maxError, error);
+    }
+
+    avgError = count ? (float)(sum / count) : 0;
+}
+
+class MaterialLess
+{
+public:
+    const std::vector<int>& materials;
+
+    MaterialLess(const std::vector<int>& m) : materials(m) {}
+
+    bool operator()(int a, int b) const { return materials[a] < materials[b]; }
+};
+
+bool Simplification::output(DTSMesh& result)
+{
+    std::vector<int> triangles, remap(numVertices, -1);
+    int              t, count = 0;
+
+    for (t = 0; t < numTriangles; t++)
+    {
+        if (!deadTriangle[t])
+        {
+            triangles.push_back(t);
+        }
+    }
+
+    if ((int)triangles.size() * 3 > DTSMeshTools::MaxIndices)
+    {
+        return false;
+    }
+
+    std::stable_sort(triangles.begin(), triangles.end(), MaterialLess(materials));
+
+    // Vertices renumbered in order of first use.
+    std::vector<int> vertices;
+
+    for (size_t i = 0; i < triangles.size() * 3; i++)
+    {
+        int v = cornerVertex[triangles[i / 3] * 3 + i % 3];
+
+        if (remap[v] == -1)
+        {
+            remap[v] = count++;
+            vertices.push_back(v);
+        }
+    }
+
+    result.type      = mesh.type;
+    result.numFrames = 1;
+    result.matFrames = 1;
+    result.parent    = mesh.parent;
+    result.bounds    = mesh.bounds;
+    result.center    = mesh.center;
+    result.radius    = mesh.radius;
+    result.flags     = mesh.flags;
+
+    result.vertsPerFrame = count;
+    result.verts   .resize(count);
+    result.tverts  .resize(count);
+    result.normals .resize(count);
+    result.enormals.resize(count);
+
+    for (int v = 0; v < count; v++)
+    {
+        int source = vertices[v];
+
+        result.verts[v] = mesh.verts[source];
+
+        if (source < (int)mesh.tverts.size())   result.tverts  [v] = mesh.tverts  [source];
+        if (source < (int)mesh.normals.size())  result.normals [v] = mesh.normals [source];
+        if (source < (int)mesh.enormals.size()) result.enormals[v] = mesh.enormals[source];
+    }
+
+    DTSTriangles lists;
+
+    lists.indices  .reserve(triangles.size() * 3);
+    lists.materials.reserve(triangles.size());
+
+    for (size_t i = 0; i < triangles.size(); i++)
+    {
+        for (int corner = 0; corner < 3; corner++)
+        {
+            lists.indices.push_back(remap[cornerVertex[triangles[i] * 3 + corner]]);
+        }
+
+        lists.materials.push_back(materials[triangles[i]]);
+    }
+
+    result.primitives = mesh.primitives;
+    result.mindices.clear();
+    DTSMeshTools::setTriangles(result, lists);
+
+    result.vindex       .clear();
+    result.vbone        .clear();
+    result.vweight      .clear();
+    result.nodeIndex     = mesh.nodeIndex;
+    result.nodeTransform = mesh.nodeTransform;
+
+    for (size_t w = 0; w < mesh.vindex.size(); w++)
+    {
+        int v = mesh.vindex[w];
+
+        if (v < numVertices && remap[v] != -1)
+        {
+            result.vindex .push_back(remap[v]);
+            result.vbone  .push_back(mesh.vbone[w]);
+            result.vweight.push_back(mesh.vweight[w]);
+        }
+    }
+
+    return true;
+}
+
+bool DTSSimplifier::simplify(const DTSMesh& source, float ratio, DTSMesh& result, float& avgError, float& maxError)
+{
+    avgError = 0;
+    maxError = 0;
+
+    if ((source.type != DTSMesh::T_Standard && source.type != DTSMesh::T_Skin) ||
+        source.numFrames > 1 || source.matFrames > 1 || source.vertsPerFrame <= 0 ||
+        (int)source.verts.size() < source.vertsPerFrame)
+    {
+        return false;
+    }
+
+    DTSTriangles   triangles;
+    Simplification simplification(source);
+
+    DTSMeshTools::expandTriangles(source, triangles);
+    simplification.build(triangles);
+
+    if (simplification.numTriangles == 0)
+    {
+        return false;
+    }
+
+    simplification.lockBoundaries();
+    simplification.buildInfluences();
+    simplification.run(std::max(1, (int)(ratio * simplification.numTriangles + 0.5f)));
+    simplification.measure(avgError, maxError);
+    return simplification.output(result);
+}
+
+void DTSSimplifier::generateDetailLevels(DTSShape& shape, const std::vector<float>& ratios)
+{
+    int numObjects = (int)shape.objects.size();
+    int object, mesh;
+
+    std::vector<float> sortedRatios(ratios);
+
+    std::sort(sortedRatios.begin(), sortedRatios.end(), std::greater<float>());
+
+    std::vector<std::vector<DTSMesh> > added(numObjects);
+    std::vector<DTSDetailLevel>        levels;
+
+    for (int subshapeIndex = 0; subshapeIndex < (int)shape.subshapes.size(); subshapeIndex++)
+    {
+        const DTSSubshape& subshape(shape.subshapes[subshapeIndex]);
+
+        int base = -1;
+
+        for (int level = 0; level < (int)shape.detailLevels.size(); level++)
+        {
+            const DTSDetailLevel& detail(shape.detailLevels[level]);
+
+            if (detail.subshape == subshapeIndex && detail.size >= 0 && (base == -1 || detail.size > shape.detailLevels[base].size))
+            {
+                base = level;
+            }
+        }
+
+        if (base == -1)
+        {
+            continue;
+        }
+
+        const DTSDetailLevel baseLevel(shape.detailLevels[base]);
+        float                previousSize = baseLevel.size;
+
+        for (size_t r = 0; r < sortedRatios.size(); r++)
+        {
+            int    slot = 0;
+            int    polyCount = 0;
+            double errorSum = 0;
+            int    errorWeight = 0;
+            float  maxError = 0;
+
+            for (object = subshape.firstObject; object < subshape.firstObject + subshape.numObjects; object++)
+            {
+                slot = std::max(slot, shape.objects[object].numMeshes + (int)added[object].size());
+            }
+
+            for (object = subshape.firstObject; object < subshape.firstObject + subshape.numObjects; object++)
+            {
+                const DTSObject& dtsObject(shape.objects[object]);
+
+                while (dtsObject.numMeshes + (int)added[object].size() < slot)
+                {
+                    added[object].push_back(DTSMesh());
+                }
+
+                added[object].push_back(DTSMesh());
+
+                DTSMesh& generated(added[object].back());
+
+                if (baseLevel.objectDetail < 0 || baseLevel.objectDetail >= dtsObject.numMeshes)
+                {
+                    continue;
+                }
+
+                mesh = dtsObject.firstMesh + baseLevel.objectDetail;
+
+                float avgError, meshMaxError;
+
+                if (shape.meshLoaded[mesh] && DTSSimplifier::simplify(shape.meshes[mesh], sortedRatios[r], generated, avgError, meshMaxError))
+                {
+                    errorSum    += avgError * shape.meshes[mesh].vertsPerFrame;
+                    errorWeight += shape.meshes[mesh].vertsPerFrame;
+                    maxError     = std::max(maxError, meshMaxError);
+                    polyCount   += (int)generated.indices.size() / 3;
+                }
+            }
+
+            char name[64];
+
+            snprintf(name, sizeof(name), "_%i%%", (int)(sortedRatios[r] * 100.0f + 0.5f));
+
+            DTSDetailLevel level;
+
+            level.name         = (int)shape.names.size();
+            level.subshape     = subshapeIndex;
+            level.objectDetail = slot;
+            level.avgError     = errorWeight ? (float)(errorSum / errorWeight) : 0;
+            level.maxError     = maxError;
+            level.polyCount    = polyCount;
+            level.size         = previousSize * 0.999f;
+
+            // Switch where the error covers about a pixel, but never before the level above.
+            if (maxError > 0)
+            {
+                level.size = std::min(level.size, 2.0f * shape.radius / maxError);
+            }
+
+            previousSize = level.size;
+
+            shape.names.push_back((baseLevel.name != -1 ? shape.names[baseLevel.name] : std::string("detail")) + name);
+            levels.push_back(level);
+        }
+    }
+
+    // Rebuild the mesh list so every object's meshes stay contiguous.
+    std::vector<DTSMesh> meshes;
+    std::vector<bool>    loaded;
+    std::vector<int>     remap(shape.meshes.size(), -1);
+
+    for (object = 0; object < numObjects; object++)
+    {
+        DTSObject& dtsObject(shape.objects[object]);
+        int        first = (int)meshes.size();
+
+        for (mesh = dtsObject.firstMesh; mesh < dtsObject.firstMesh + dtsObject.numMeshes; mesh++)
+        {
+            remap[mesh] = (int)meshes.size();
+            meshes.push_back(DTSMesh());
+            meshes.back().swap(shape.meshes[mesh]);
+            loaded.push_back(shape.meshLoaded[mesh]);
+        }
+
+        for (size_t m = 0; m < added[object].size(); m++)
+        {
+            meshes.push_back(DTSMesh());
+            meshes.back().swap(added[object][m]);
+            loaded.push_back(true);
+        }
+
+        dtsObject.firstMesh = first;
+        dtsObject.numMeshes = (int)meshes.size() - first;
+    }
+
+    for (mesh = 0; mesh < (int)shape.meshes.size(); mesh++)
+    {
+        if (remap[mesh] == -1)
+        {
+            remap[mesh] = (int)meshes.size();
+            meshes.push_back(DTSMesh());
+            meshes.back().swap(shape.meshes[mesh]);
+            loaded.push_back(shape.meshLoaded[mesh]);
+        }
+    }
+
+    for (size_t decal = 0; decal < shape.decals.size(); decal++)
+    {
+        DTSDecal& dtsDecal(shape.decals[decal]);
+
+        if (dtsDecal.firstMesh >= 0 && dtsDecal.firstMesh < (int)remap.size())
+        {
+            dtsDecal.firstMesh = remap[dtsDecal.firstMesh];
+        }
+    }
+
+    shape.meshes    .swap(meshes);
+    shape.meshLoaded.swap(loaded);
+    shape.detailLevels.insert(shape.detailLevels.end(), levels.begin(), levels.end());
+
+    shape.numMeshes       = (int)shape.meshes.size();
+    shape.numDetailLevels = (int)shape.detailLevels.size();
+    shape.numNames        = (int)shape.names.size();
+}
@@ -0,0 +1,46 @@
+/*
+ * dts2fbx
+ * Copyright (c) 2011 Charlie Duhor. All rights reserved.
+ *
+ * @DTS2FBX_LICENSE_HEADER_START@
+ * 
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ * 
+ * @DTS2FBX_LICENSE_HEADER_START@
+ */
+
+#ifndef DTSConverter_DTSSimplify_h
+#define DTSConverter_DTSSimplify_h
+
+#include "DTSShape.h"
+
+#include <vector>
+
+class DTSSimplifier
+{
+public:
+    // Quadric error edge collapse of a standard or skinned mesh down to about
+    // ratio of its triangles. UV seams, material and open boundaries are
+    // kept, and vertices are only merged with ones of similar skin weights.
+    // The errors are distances in shape units, as in DTSDetailLevel.
+    static bool simplify(const DTSMesh& source, float ratio, DTSMesh& result, float& avgError, float& maxError);
+
+    // Appends one detail level per ratio to every subshape, simplified from
+    // its most detailed level.
+    static void generateDetailLevels(DTSShape& shape, const std::vector<float>& ratios);
+};
+
+#endif
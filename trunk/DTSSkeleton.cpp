@@ -0,0 +1,680 @@
+/*
+ * dts2fbx
+ * Copyright (c) 2011 Charlie Duhor. All rights reserved.
+ *
+ * @DTS2FBX_LICENSE_HEADER_START@
+ * 
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ * 
+ * @DTS2FBX_LICENSE_HEADER_START@
+ */
+
+#include "DTSSkeleton.h"
+#include "DTSMath.h"
+
+#include <math.h>
+#include <algorithm>
+
+void DTSNodeMap::build(const DTSShape& shape)
+{
+    nodes.clear();
+
+    // Later duplicates are ignored, as DTSShape::findNode() would.
+    for (int node = 0; node < (int)shape.nodes.size(); node++)
+    {
+        if (shape.nodes[node].name >= 0 && shape.nodes[node].name < (int)shape.names.size())
+        {
+            nodes.insert(std::make_pair(shape.names[shape.nodes[node].name], node));
+        }
+    }
+}
+
+int DTSNodeMap::match(const DTSShape& shape, const DTSShape& file, std::vector<int>& shapeNodes) const
+{
+    int unmatched = 0;
+
+    shapeNodes.clear();
+
+    if (&shape == &file)
+    {
+        for (int node = 0; node < (int)shape.nodes.size(); node++)
+        {
+            shapeNodes.push_back(node);
+        }
+
+        return 0;
+    }
+
+    std::vector<std::string>::const_iterator it, end(file.names.end());
+
+    for (it = file.names.begin(); it != end; ++it)
+    {
+        std::map<std::string, int>::const_iterator found(nodes.find(*it));
+
+        if (found != nodes.end())
+        {
+            shapeNodes.push_back(found->second);
+        }
+        else
+        {
+            shapeNodes.push_back(-1);
+            unmatched++;
+        }
+    }
+
+    return unmatched;
+}
+
+void DTSSkeleton::topDownOrder(const DTSShape& shape, std::vector<int>& order)
+{
+    int numNodes = (int)shape.nodes.size();
+    int index, maxDepth = 0;
+
+    std::vector<int> depth(numNodes, -1);
+
+    for (index = 0; index < numNodes; index++)
+    {
+        int node = index, d = 0;
+
+        while (node != -1 && depth[node] == -1 && d <= numNodes)
+        {
+            node = shape.nodes[node].parent;
+            d++;
+        }
+
+        d += (node == -1 || d > numNodes) ? -1 : depth[node];
+
+        for (node = index; node != -1 && depth[node] == -1; node = shape.nodes[node].parent, d--)
+        {
+            depth[node] = d;
+        }
+
+        if (depth[index] > maxDepth)
+        {
+            maxDepth = depth[index];
+        }
+    }
+
+    // Counting sort on the depth, stable so siblings keep their file order.
+    std::vector<int> first(maxDepth + 2, 0);
+
+    for (index = 0; index < numNodes; index++)
+    {
+        first[depth[index] + 1]++;
+    }
+
+    for (index = 0; index <= maxDepth; index++)
+    {
+        first[index + 1] += first[index];
+    }
+
+    order.resize(numNodes);
+
+    for (index = 0; index < numNodes; index++)
+    {
+        order[first[depth[index]]++] = index;
+    }
+}
+
+void DTSSkeletonPose::resize(int numNodes)
+{
+    qx.resize(numNodes); qy.resize(numNodes); qz.resize(numNodes); qw.resize(numNodes);
+    tx.resize(numNodes); ty.resize(numNodes); tz.resize(numNodes);
+}
+
+void DTSSkeletonPose::computeBindPose(const DTSShape& shape)
+{
+    int numNodes = (int)shape.nodes.size();
+
+    DTSSkeletonPose  defaults;
+    std::vector<int> order;
+
+    defaults.resize(numNodes);
+
+    for (int node = 0; node < numNodes; node++)
+    {
+        const Quaternion& q(shape.nodeDefRotations   [node]);
+        const Point&      t(shape.nodeDefTranslations[node]);
+
+        defaults.qx[node] = q.x; defaults.qy[node] = q.y; defaults.qz[node] = q.z; defaults.qw[node] = q.w;
+        defaults.tx[node] = t.x; defaults.ty[node] = t.y; defaults.tz[node] = t.z;
+    }
+
+    DTSSkeleton::topDownOrder(shape, order);
+    composeWorld(shape, order, defaults);
+}
+
+void DTSSkeletonPose::composeWorld(const DTSShape& shape, const std::vector<int>& order, const DTSSkeletonPose& local)
+{
+    int numNodes = (int)order.size();
+
+    resize(numNodes);
+
+    for (int index = 0; index < numNodes; index++)
+    {
+        int        node   = order[index];
+        int        parent = shape.nodes[node].parent;
+        Quaternion q      = local.rotation   (node);
+        Point      t      = local.translation(node);
+
+        if (parent != -1)
+        {
+            Quaternion parentRotation(rotation(parent));
+            Point      parentOffset  (DTSMath::rotate(parentRotation, t));
+
+            q   = DTSMath::compose(q, parentRotation);
+            t.x = tx[parent] + parentOffset.x;
+            t.y = ty[parent] + parentOffset.y;
+            t.z = tz[parent] + parentOffset.z;
+        }
+
+        qx[node] = q.x; qy[node] = q.y; qz[node] = q.z; qw[node] = q.w;
+        tx[node] = t.x; ty[node] = t.y; tz[node] = t.z;
+    }
+}
+
+Quaternion DTSSkeletonPose::rotation(int node) const
+{
+    Quaternion q;
+
+    q.x = qx[node]; q.y = qy[node]; q.z = qz[node]; q.w = qw[node];
+    return q;
+}
+
+Point DTSSkeletonPose::translation(int node) const
+{
+    Point p;
+
+    p.x = tx[node]; p.y = ty[node]; p.z = tz[node];
+    return p;
+}
+
+float DTSSkeletonPose::checkInverseBind(const DTSMesh& mesh) const
+{
+    float maxError = 0;
+    int   bone, numBones = (int)mesh.nodeIndex.size();
+
+    if ((int)mesh.nodeTransform.size() < numBones)
+    {
+        numBones = (int)mesh.nodeTransform.size();
+    }
+
+    for (bone = 0; bone < numBones; bone++)
+    {
+        Matrix<4,4> world;
+        int         node = mesh.nodeIndex[bone];
+
+        DTSMath::toMatrix(rotation(node), translation(node), world);
+
+        const float* a = world.data;
+        const float* b = mesh.nodeTransform[bone].data;
+
+        for (int r = 0; r < 3; r++)
+        {
+            for (int c = 0; c < 4; c++)
+            {
+                float v = a[r * 4 + 0] * b[0 * 4 + c] + a[r * 4 + 1] * b[1 * 4 + c] +
+                          a[r * 4 + 2] * b[2 * 4 + c] + a[r * 4 + 3] * b[3 * 4 + c];
+
+                float e = fabsf(v - ((r == c) ? 1.0f : 0.0f));
+
+                if (e > maxError)
+                {
+                    maxError = e;
+                }
+            }
+        }
+    }
+
+    return maxError;
+}
+
+static bool isAnimated(const DTSSequence& sequence, int node)
+{
+    return (node < (int)sequence.matters.rotation   .size() && sequence.matters.rotation   [node]) ||
+           (node < (int)sequence.matters.translation.size() && sequence.matters.translation[node]) ||
+           (node < (int)sequence.matters.scale      .size() && sequence.matters.scale      [node]);
+}
+
+static void removeNodes(std::vector<bool>& bits, const std::vector<int>& remap)
+{
+    std::vector<bool> kept;
+
+    for (size_t index = 0; index < bits.size(); index++)
+    {
+        if (index >= remap.size() || remap[index] != -1)
+        {
+            kept.push_back(bits[index]);
+        }
+    }
+
+    bits.swap(kept);
+}
+
+int DTSSkeleton::prune(DTSShape& shape, const std::vector<DTSShape>& sequenceFiles)
+{
+    int numNodes = (int)shape.nodes.size();
+    int node;
+
+    std::vector<bool> needed(numNodes, false);
+
+    for (size_t object = 0; object < shape.objects.size(); object++)
+    {
+        node = shape.objects[object].node;
+
+        if (node >= 0 && node < numNodes)
+        {
+            needed[node] = true;
+        }
+    }
+
+    std::vector<DTSMesh>::const_iterator meshIt, meshEnd(shape.meshes.end());
+
+    for (meshIt = shape.meshes.begin(); meshIt != meshEnd; ++meshIt)
+    {
+        const DTSMesh& mesh(*meshIt);
+
+        if (mesh.type != DTSMesh::T_Skin)
+        {
+            continue;
+        }
+
+        for (size_t weight = 0; weight < mesh.vweight.size(); weight++)
+        {
+            int bone = mesh.vbone[weight];
+
+            if (mesh.vweight[weight] > 0 && bone >= 0 && bone < (int)mesh.nodeIndex.size())
+            {
+                needed[mesh.nodeIndex[bone]] = true;
+            }
+        }
+    }
+
+    std::vector<DTSSequence>::const_iterator seqIt, seqEnd(shape.sequences.end());
+
+    for (seqIt = shape.sequences.begin(); seqIt != seqEnd; ++seqIt)
+    {
+        for (node = 0; node < numNodes; node++)
+        {
+            needed[node] = needed[node] || isAnimated(*seqIt, node);
+        }
+    }
+
+    // Sequence files index their own node names.
+    DTSNodeMap       nodeMap(shape);
+    std::vector<int> shapeNodes;
+
+    std::vector<DTSShape>::const_iterator fileIt, fileEnd(sequenceFiles.end());
+
+    for (fileIt = sequenceFiles.begin(); fileIt != fileEnd; ++fileIt)
+    {
+        const DTSShape& file(*fileIt);
+
+        nodeMap.match(shape, file, shapeNodes);
+
+        for (seqIt = file.sequences.begin(), seqEnd = file.sequences.end(); seqIt != seqEnd; ++seqIt)
+        {
+            for (size_t fileNode = 0; fileNode < file.names.size(); fileNode++)
+            {
+                if (isAnimated(*seqIt, (int)fileNode) && shapeNodes[fileNode] != -1)
+                {
+                    needed[shapeNodes[fileNode]] = true;
+                }
+            }
+        }
+    }
+
+    // Ancestors, children first.
+    std::vector<int> order;
+
+    topDownOrder(shape, order);
+
+    for (int index = numNodes - 1; index >= 0; index--)
+    {
+        node = order[index];
+
+        if (needed[node] && shape.nodes[node].parent != -1)
+        {
+            needed[shape.nodes[node].parent] = true;
+        }
+    }
+
+    // Nothing needed hangs below a removed node, so no transform has to be
+    // folded into the remaining ones.
+    std::vector<int> remap(numNodes, -1);
+    int              kept = 0;
+
+    for (node = 0; node < numNodes; node++)
+    {
+        if (needed[node])
+        {
+            remap[node] = kept++;
+        }
+    }
+
+    if (kept == numNodes)
+    {
+        return 0;
+    }
+
+    std::vector<DTSNode>    nodes;
+    std::vector<Quaternion> rotations;
+    std::vector<Point>      translations;
+
+    for (node = 0; node < numNodes; node++)
+    {
+        if (remap[node] == -1)
+        {
+            continue;
+        }
+
+        DTSNode dtsNode(shape.nodes[node]);
+
+        dtsNode.parent  = dtsNode.parent == -1 ? -1 : remap[dtsNode.parent];
+        dtsNode.child   = -1;
+        dtsNode.sibling = -1;
+
+        nodes       .push_back(dtsNode);
+        rotations   .push_back(shape.nodeDefRotations   [node]);
+        translations.push_back(shape.nodeDefTranslations[node]);
+    }
+
+    // Removed nodes would cut the child and sibling chains, relink them from
+    // the parents in node order, as the engine does at load.
+    std::vector<int> lastChild(kept, -1);
+
+    for (node = 0; node < kept; node++)
+    {
+        int parent = nodes[node].parent;
+
+        if (parent < 0)
+        {
+            continue;
+        }
+
+        if (lastChild[parent] == -1)
+        {
+            nodes[parent].child = node;
+        }
+        else
+        {
+            nodes[lastChild[parent]].sibling = node;
+        }
+
+        lastChild[parent] = node;
+    }
+
+    shape.nodes              .swap(nodes);
+    shape.nodeDefRotations   .swap(rotations);
+    shape.nodeDefTranslations.swap(translations);
+    shape.numNodes = kept;
+
+    std::vector<DTSSubshape>::iterator subshapeIt, subshapeEnd(shape.subshapes.end());
+
+    for (subshapeIt = shape.subshapes.begin(); subshapeIt != subshapeEnd; ++subshapeIt)
+    {
+        DTSSubshape& subshape(*subshapeIt);
+
+        int first = kept, count = 0;
+
+        for (node = subshape.firstNode; node < subshape.firstNode + subshape.numNodes && node < numNodes; node++)
+        {
+            if (remap[node] != -1)
+            {
+                first = std::min(first, remap[node]);
+                count++;
+            }
+        }
+
+        if (count == 0)
+        {
+            // Keep the position of the empty range.
+            for (first = 0, node = 0; node < subshape.firstNode && node < numNodes; node++)
+            {
+                first += remap[node] != -1 ? 1 : 0;
+            }
+        }
+
+        subshape.firstNode = first;
+        subshape.numNodes  = count;
+    }
+
+    std::vector<DTSObject>::iterator objectIt, objectEnd(shape.objects.end());
+
+    for (objectIt = shape.objects.begin(); objectIt != objectEnd; ++objectIt)
+    {
+        if ((*objectIt).node >= 0 && (*objectIt).node < numNodes)
+        {
+            (*objectIt).node = remap[(*objectIt).node];
+        }
+    }
+
+    std::vector<DTSMesh>::iterator meshWriteIt, meshWriteEnd(shape.meshes.end());
+
+    for (meshWriteIt = shape.meshes.begin(); meshWriteIt != meshWriteEnd; ++meshWriteIt)
+    {
+        DTSMesh& mesh(*meshWriteIt);
+
+        if (mesh.type != DTSMesh::T_Skin)
+        {
+            continue;
+        }
+
+        // Bones of removed nodes carry no weight, drop them from the palette.
+        std::vector<int>          boneRemap(mesh.nodeIndex.size(), -1);
+        std::vector<int>          nodeIndex;
+        std::vector<Matrix<4,4> > nodeTransform;
+
+        for (size_t bone = 0; bone < mesh.nodeIndex.size(); bone++)
+        {
+            if (remap[mesh.nodeIndex[bone]] != -1)
+            {
+                boneRemap[bone] = (int)nodeIndex.size();
+                nodeIndex.push_back(remap[mesh.nodeIndex[bone]]);
+
+                if (bone < mesh.nodeTransform.size())
+                {
+                    nodeTransform.push_back(mesh.nodeTransform[bone]);
+                }
+            }
+        }
+
+        size_t out = 0;
+
+        for (size_t weight = 0; weight < mesh.vbone.size(); weight++)
+        {
+            int bone = mesh.vbone[weight];
+
+            if (bone >= 0 && bone < (int)boneRemap.size() && boneRemap[bone] != -1)
+            {
+                mesh.vindex [out] = mesh.vindex[weight];
+                mesh.vbone  [out] = boneRemap[bone];
+                mesh.vweight[out] = mesh.vweight[weight];
+                out++;
+            }
+        }
+
+        mesh.vindex .resize(out);
+        mesh.vbone  .resize(out);
+        mesh.vweight.resize(out);
+        mesh.nodeIndex    .swap(nodeIndex);
+        mesh.nodeTransform.swap(nodeTransform);
+    }
+
+    // Removed nodes have no keys, only the per node bits move.
+    std::vector<DTSSequence>::iterator seqWriteIt, seqWriteEnd(shape.sequences.end());
+
+    for (seqWriteIt = shape.sequences.begin(); seqWriteIt != seqWriteEnd; ++seqWriteIt)
+    {
+        removeNodes((*seqWriteIt).matters.rotation,    remap);
+        removeNodes((*seqWriteIt).matters.translation, remap);
+        removeNodes((*seqWriteIt).matters.scale,       remap);
+
+        (*seqWriteIt).buildKeyIndex();
+    }
+
+    return numNodes - kept;
+}
+
+DTSPoseSampler::DTSPoseSampler() :
+    slerp    (false),
+    _shape   (NULL),
+    _file    (NULL),
+    _sequence(NULL)
+{
+}
+
+void DTSPoseSampler::setSequence(const DTSShape& shape, const DTSShape& file, const std::vector<int>& shapeNodes, const DTSSequence& sequence)
+{
+    int numNodes = (int)shape.nodes.size();
+    int node;
+
+    _shape    = &shape;
+    _file     = &file;
+    _sequence = &sequence;
+
+    DTSSkeleton::topDownOrder(shape, _order);
+
+    local.resize(numNodes);
+    world.resize(numNodes);
+    _next.resize(numNodes);
+
+    _rotationKeys   .assign(numNodes, -1);
+    _translationKeys.assign(numNodes, -1);
+
+    // Without keys every node keeps its default transform.
+    int numFileNodes = (sequence.numKeyFrames > 0) ? std::min((int)sequence.matters.rotation.size(), (int)shapeNodes.size()) : 0;
+
+    for (int fileNode = 0; fileNode < numFileNodes; fileNode++)
+    {
+        node = shapeNodes[fileNode];
+
+        if (node < 0 || node >= numNodes)
+        {
+            continue;
+        }
+
+        int rotationKey    = sequence.rotationKey   (fileNode, 0);
+        int translationKey = sequence.translationKey(fileNode, 0);
+
+        if (rotationKey >= 0 && rotationKey + sequence.numKeyFrames <= (int)file.nodeRotations.size())
+        {
+            _rotationKeys[node] = rotationKey;
+        }
+
+        if (translationKey >= 0 && translationKey + sequence.numKeyFrames <= (int)file.nodeTranslations.size())
+        {
+            _translationKeys[node] = translationKey;
+        }
+    }
+}
+
+void DTSPoseSampler::sample(float time)
+{
+    sampleLocal(time);
+    world.composeWorld(*_shape, _order, local);
+}
+
+void DTSPoseSampler::sampleLocal(float time)
+{
+    int   key0, key1;
+    float blend;
+
+    _sequence->keysAt(time, key0, key1, blend);
+    sampleKeys(key0, key1, blend);
+}
+
+void DTSPoseSampler::sampleKeys(int key0, int key1, float blend)
+{
+    int numNodes = (int)_order.size();
+    int node;
+
+    // Gather both surrounding keys of every node, or its default transform.
+    const std::vector<Quaternion>& defRotations   (_shape->nodeDefRotations);
+    const std::vector<Point>&      defTranslations(_shape->nodeDefTranslations);
+
+    for (node = 0; node < numNodes; node++)
+    {
+        int rotationKey    = _rotationKeys   [node];
+        int translationKey = _translationKeys[node];
+
+        Quaternion q0 = (rotationKey    >= 0) ? _file->nodeRotation   (rotationKey    + key0) : defRotations   [node];
+        Quaternion q1 = (rotationKey    >= 0) ? _file->nodeRotation   (rotationKey    + key1) : defRotations   [node];
+        Point      t0 = (translationKey >= 0) ? _file->nodeTranslation(translationKey + key0) : defTranslations[node];
+        Point      t1 = (translationKey >= 0) ? _file->nodeTranslation(translationKey + key1) : defTranslations[node];
+
+        local.qx[node] = q0.x; local.qy[node] = q0.y; local.qz[node] = q0.z; local.qw[node] = q0.w;
+        local.tx[node] = t0.x; local.ty[node] = t0.y; local.tz[node] = t0.z;
+        _next.qx[node] = q1.x; _next.qy[node] = q1.y; _next.qz[node] = q1.z; _next.qw[node] = q1.w;
+        _next.tx[node] = t1.x; _next.ty[node] = t1.y; _next.tz[node] = t1.z;
+    }
+
+    if (blend == 0 || numNodes == 0)
+    {
+        return;
+    }
+
+    // Blend all channels at once; branch free so the loops vectorize.
+    float* qx = &local.qx[0]; float* qy = &local.qy[0]; float* qz = &local.qz[0]; float* qw = &local.qw[0];
+    float* tx = &local.tx[0]; float* ty = &local.ty[0]; float* tz = &local.tz[0];
+
+    const float* nqx = &_next.qx[0]; const float* nqy = &_next.qy[0]; const float* nqz = &_next.qz[0]; const float* nqw = &_next.qw[0];
+    const float* ntx = &_next.tx[0]; const float* nty = &_next.ty[0]; const float* ntz = &_next.tz[0];
+
+    for (node = 0; node < numNodes; node++)
+    {
+        tx[node] += (ntx[node] - tx[node]) * blend;
+        ty[node] += (nty[node] - ty[node]) * blend;
+        tz[node] += (ntz[node] - tz[node]) * blend;
+    }
+
+    if (slerp)
+    {
+        for (node = 0; node < numNodes; node++)
+        {
+            float d    = qx[node] * nqx[node] + qy[node] * nqy[node] + qz[node] * nqz[node] + qw[node] * nqw[node];
+            float sign = (d < 0) ? -1.0f : 1.0f;
+            float c    = (d * sign > 1.0f) ? 1.0f : d * sign;
+            float a    = acosf(c);
+            float s    = sinf(a);
+            bool  near = s < 1e-4f;
+            float w0   = near ? 1.0f - blend : sinf((1.0f - blend) * a) / s;
+            float w1   = (near ? blend : sinf(blend * a) / s) * sign;
+
+            qx[node] = qx[node] * w0 + nqx[node] * w1;
+            qy[node] = qy[node] * w0 + nqy[node] * w1;
+            qz[node] = qz[node] * w0 + nqz[node] * w1;
+            qw[node] = qw[node] * w0 + nqw[node] * w1;
+        }
+    }
+    else
+    {
+        for (node = 0; node < numNodes; node++)
+        {
+            float d  = qx[node] * nqx[node] + qy[node] * nqy[node] + qz[node] * nqz[node] + qw[node] * nqw[node];
+            float w0 = 1.0f - blend;
+            float w1 = (d < 0) ? -blend : blend;
+
+            float x = qx[node] * w0 + nqx[node] * w1;
+            float y = qy[node] * w0 + nqy[node] * w1;
+            float z = qz[node] * w0 + nqz[node] * w1;
+            float w = qw[node] * w0 + nqw[node] * w1;
+            float n = 1.0f / sqrtf(x * x + y * y + z * z + w * w);
+
+            qx[node] = x * n; qy[node] = y * n; qz[node] = z * n; qw[node] = w * n;
+        }
+    }
+}
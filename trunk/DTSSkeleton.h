@@ -0,0 +1,132 @@
+/*
+ * dts2fbx
+ * Copyright (c) 2011 Charlie Duhor. All rights reserved.
+ *
+ * @DTS2FBX_LICENSE_HEADER_START@
+ * 
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ * 
+ * @DTS2FBX_LICENSE_HEADER_START@
+ */
+
+#ifndef DTSConverter_DTSSkeleton_h
+#define DTSConverter_DTSSkeleton_h
+
+#include "DTSShape.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+class DTSSkeleton
+{
+public:
+    // Node indexes ordered so that every parent comes before its children.
+    static void topDownOrder(const DTSShape& shape, std::vector<int>& order);
+
+    // Removes the nodes that deform no vertex, are animated by no sequence
+    // (of the shape or of the sequence files, matched by name), carry no
+    // object and have no such descendant, then remaps every node reference.
+    // Returns the number of nodes removed.
+    static int prune(DTSShape& shape, const std::vector<DTSShape>& sequenceFiles);
+};
+
+// Shape nodes by name, built once and reused to match every sequence file.
+class DTSNodeMap
+{
+public:
+    std::map<std::string, int> nodes;
+
+public:
+    DTSNodeMap() {}
+    DTSNodeMap(const DTSShape& shape) { build(shape); }
+
+    void build(const DTSShape& shape);
+
+    // Shape node of every node of file, the identity for the shape itself and
+    // -1 for names the shape lacks. Returns the number of unmatched names.
+    int match(const DTSShape& shape, const DTSShape& file, std::vector<int>& shapeNodes) const;
+};
+
+class DTSSkeletonPose
+{
+public:
+    // World transform of every node, one array per component. Rotations
+    // follow the DTS convention (see DTSMath).
+    std::vector<float> qx, qy, qz, qw;
+    std::vector<float> tx, ty, tz;
+
+public:
+    void resize(int numNodes);
+
+    // Composes nodeDefRotations/nodeDefTranslations in a single top-down pass.
+    void computeBindPose(const DTSShape& shape);
+
+    // World transforms from local ones, order as given by topDownOrder().
+    void composeWorld(const DTSShape& shape, const std::vector<int>& order, const DTSSkeletonPose& local);
+
+    Quaternion rotation   (int node) const;
+    Point      translation(int node) const;
+
+    // Largest deviation from identity of world * nodeTransform over the
+    // bones of a skinned mesh.
+    float checkInverseBind(const DTSMesh& mesh) const;
+};
+
+// Evaluates a sequence at arbitrary times. setSequence() sizes every
+// buffer so that sample() runs without allocating.
+class DTSPoseSampler
+{
+public:
+    // Local and world transforms of every shape node at the last sampled
+    // time. Nodes the sequence does not animate keep their default transform.
+    DTSSkeletonPose local;
+    DTSSkeletonPose world;
+
+    // Spherical instead of normalized linear interpolation between keys.
+    bool slerp;
+
+public:
+    DTSPoseSampler();
+
+    // The sequence belongs to file, either the shape itself or a sequence
+    // file, whose nodes map to shapeNodes as given by DTSNodeMap::match().
+    void setSequence(const DTSShape& shape, const DTSShape& file, const std::vector<int>& shapeNodes, const DTSSequence& sequence);
+
+    // Time in seconds from the start of the sequence, see DTSSequence::keysAt().
+    void sample     (float time);
+    void sampleLocal(float time);
+
+    // Local pose between two keys of the sequence.
+    void sampleKeys(int key0, int key1, float blend);
+
+    // Whether the sequence has keys for a shape node.
+    bool animatesRotation   (int node) const { return _rotationKeys   [node] >= 0; }
+    bool animatesTranslation(int node) const { return _translationKeys[node] >= 0; }
+
+protected:
+    const DTSShape*    _shape;
+    const DTSShape*    _file;
+    const DTSSequence* _sequence;
+
+    std::vector<int> _order;
+    std::vector<int> _rotationKeys;     // Per shape node, first key in _file or -1
+    std::vector<int> _translationKeys;
+
+    DTSSkeletonPose _next;              // Keys after the sampled time
+};
+
+#endif
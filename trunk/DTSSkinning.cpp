@@ -0,0 +1,576 @@
+/*
+ * dts2fbx
+ * Copyright (c) 2011 Charlie Duhor. All rights reserved.
+ *
+ * @DTS2FBX_LICENSE_HEADER_START@
+ * 
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ * 
+ * @DTS2FBX_LICENSE_HEADER_START@
+ */
+
+#include "DTSSkinning.h"
+#include "DTSMeshTools.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+
+class InfluenceLess
+{
+public:
+    const DTSMesh& mesh;
+
+    InfluenceLess(const DTSMesh& m) : mesh(m) {}
+
+    // By vertex, strongest first, then by bone so ties are deterministic.
+    bool operator()(int a, int b) const
+    {
+        if (mesh.vindex [a] != mesh.vindex [b]) return mesh.vindex [a] < mesh.vindex [b];
+        if (mesh.vweight[a] != mesh.vweight[b]) return mesh.vweight[a] > mesh.vweight[b];
+        return mesh.vbone[a] < mesh.vbone[b];
+    }
+};
+
+void DTSSkinning::buildStreams(const DTSMesh& mesh, int maxInfluences, DTSSkinStreams& streams, DTSInfluenceStats& stats)
+{
+    int count = mesh.vertsPerFrame;
+    int w, numWeights = (int)mesh.vindex.size();
+
+    stats = DTSInfluenceStats();
+    stats.vertices = count;
+
+    streams.width = maxInfluences;
+    streams.joints .assign(count * maxInfluences, 0);
+    streams.weights.assign(count * maxInfluences, 0);
+
+    // One sort groups the influences by vertex, strongest first.
+    std::vector<int> order;
+
+    order.reserve(numWeights);
+
+    for (w = 0; w < numWeights; w++)
+    {
+        if (mesh.vindex[w] >= 0 && mesh.vindex[w] < count && mesh.vweight[w] > 0)
+        {
+            order.push_back(w);
+        }
+    }
+
+    std::sort(order.begin(), order.end(), InfluenceLess(mesh));
+
+    double errorSum = 0;
+
+    for (size_t start = 0; start < order.size(); )
+    {
+        int    vertex = mesh.vindex[order[start]];
+        size_t end    = start;
+        float  total  = 0;
+
+        while (end < order.size() && mesh.vindex[order[end]] == vertex)
+        {
+            total += mesh.vweight[order[end]];
+            end++;
+        }
+
+        int kept = std::min((int)(end - start), maxInfluences);
+
+        if ((int)(end - start) > maxInfluences)
+        {
+            stats.prunedVertices++;
+            stats.prunedInfluences += (int)(end - start) - maxInfluences;
+        }
+
+        float keptTotal = 0;
+        int   i;
+
+        for (i = 0; i < kept; i++)
+        {
+            keptTotal += mesh.vweight[order[start + i]];
+        }
+
+        // Largest remainder rounding so the quantized weights sum to 255.
+        int   quantized[256];
+        float remainder[256];
+        int   sum = 0;
+
+        for (i = 0; i < kept; i++)
+        {
+            float scaled = mesh.vweight[order[start + i]] / keptTotal * 255.0f;
+
+            quantized[i] = (int)floorf(scaled);
+            remainder[i] = scaled - quantized[i];
+            sum         += quantized[i];
+        }
+
+        while (sum < 255)
+        {
+            int best = 0;
+
+            for (i = 1; i < kept; i++)
+            {
+                if (remainder[i] > remainder[best])
+                {
+                    best = i;
+                }
+            }
+
+            quantized[best]++;
+            remainder[best] = -1;
+            sum++;
+        }
+
+        float error = 0;
+
+        for (i = 0; i < (int)(end - start); i++)
+        {
+            float original = mesh.vweight[order[start + i]] / total;
+            float final    = i < kept ? quantized[i] / 255.0f : 0;
+
+            error += fabsf(original - final);
+        }
+
+        for (i = 0; i < kept; i++)
+        {
+            streams.joints [vertex * maxInfluences + i] = (unsigned short)mesh.vbone[order[start + i]];
+            streams.weights[vertex * maxInfluences + i] = (unsigned char)quantized[i];
+        }
+
+        errorSum      += error;
+        stats.maxError = std::max(stats.maxError, error);
+
+        start = end;
+    }
+
+    stats.avgError = count ? (float)(errorSum / count) : 0;
+}
+
+void DTSSkinning::applyStreams(const DTSSkinStreams& streams, DTSMesh& mesh)
+{
+    int count = streams.width ? (int)streams.weights.size() / streams.width : 0;
+
+    mesh.vindex .clear();
+    mesh.vbone  .clear();
+    mesh.vweight.clear();
+
+    for (int vertex = 0; vertex < count; vertex++)
+    {
+        for (int i = 0; i < streams.width; i++)
+        {
+            int slot = vertex * streams.width + i;
+
+            if (streams.weights[slot] > 0)
+            {
+                mesh.vindex .push_back(vertex);
+                mesh.vbone  .push_back(streams.joints[slot]);
+                mesh.vweight.push_back(streams.weights[slot] / 255.0f);
+            }
+        }
+    }
+}
+
+static void putU8(std::vector<unsigned char>& out, unsigned int value)
+{
+    out.push_back((unsigned char)value);
+}
+
+static void putU16(std::vector<unsigned char>& out, unsigned int value)
+{
+    putU8(out, value);
+    putU8(out, value >> 8);
+}
+
+static void putU32(std::vector<unsigned char>& out, unsigned int value)
+{
+    putU16(out, value);
+    putU16(out, value >> 16);
+}
+
+void DTSSkinStreamFile::add(const std::string& name, const DTSMesh& mesh, int width)
+{
+    DTSInfluenceStats stats;
+
+    // The influences already hold at most width weights of n/255 each, so
+    // building the streams again gives back the same influences, strongest
+    // first.
+    names  .push_back(name);
+    bones  .push_back(mesh.nodeIndex);
+    streams.push_back(DTSSkinStreams());
+
+    DTSSkinning::buildStreams(mesh, width, streams.back(), stats);
+}
+
+bool DTSSkinStreamFile::write(const char* path) const
+{
+    std::vector<unsigned char> out;
+    size_t                     mesh, index;
+
+    out.push_back('D'); out.push_back('S'); out.push_back('K'); out.push_back('N');
+    putU16(out, 1);
+    putU16(out, (unsigned int)names.size());
+
+    for (mesh = 0; mesh < names.size(); mesh++)
+    {
+        const DTSSkinStreams& s(streams[mesh]);
+
+        putU16(out, (unsigned int)names[mesh].size());
+        out.insert(out.end(), names[mesh].begin(), names[mesh].end());
+        putU32(out, s.width ? (unsigned int)(s.weights.size() / s.width) : 0);
+        putU8 (out, s.width);
+        putU8 (out, 0);
+        putU16(out, (unsigned int)bones[mesh].size());
+
+        for (index = 0; index < bones[mesh].size(); index++)
+        {
+            putU16(out, bones[mesh][index]);
+        }
+
+        for (index = 0; index < s.joints.size(); index++)
+        {
+            putU16(out, s.joints[index]);
+        }
+
+        out.insert(out.end(), s.weights.begin(), s.weights.end());
+    }
+
+    FILE* f = fopen(path, "wb");
+
+    if (f == NULL)
+    {
+        return false;
+    }
+
+    bool written = fwrite(&out[0], 1, out.size(), f) == out.size();
+
+    return fclose(f) == 0 && written;
+}
+
+static int countMaterialRuns(const DTSTriangles& triangles)
+{
+    int runs = 0;
+
+    for (int t = 0; t < triangles.count(); t++)
+    {
+        if (t == 0 || triangles.materials[t] != triangles.materials[t - 1])
+        {
+            runs++;
+        }
+    }
+
+    return runs;
+}
+
+class PartTriangleLess
+{
+public:
+    const std::vector<int>& materials;
+
+    PartTriangleLess(const std::vector<int>& m) : materials(m) {}
+
+    bool operator()(int a, int b) const { return materials[a] < materials[b]; }
+};
+
+bool DTSSkinning::splitPalette(const DTSMesh& mesh, int paletteSize, std::vector<DTSMesh>& parts, DTSPaletteStats& stats)
+{
+    stats = DTSPaletteStats();
+    parts.clear();
+
+    if (mesh.type != DTSMesh::T_Skin || mesh.numFrames > 1 || mesh.matFrames > 1 ||
+        paletteSize <= 0 || mesh.vertsPerFrame <= 0 || (int)mesh.verts.size() < mesh.vertsPerFrame)
+    {
+        return false;
+    }
+
+    int count    = mesh.vertsPerFrame;
+    int numBones = (int)mesh.nodeIndex.size();
+    int t, v, w;
+
+    // Influences grouped by vertex.
+    std::vector<int> influenceStart(count + 1, 0), influences;
+
+    for (w = 0; w < (int)mesh.vindex.size(); w++)
+    {
+        if (mesh.vindex[w] >= 0 && mesh.vindex[w] < count && mesh.vbone[w] >= 0 && mesh.vbone[w] < numBones)
+        {
+            influenceStart[mesh.vindex[w] + 1]++;
+        }
+    }
+
+    for (v = 0; v < count; v++)
+    {
+        influenceStart[v + 1] += influenceStart[v];
+    }
+
+    influences.resize(influenceStart[count]);
+
+    std::vector<int> cursor(influenceStart.begin(), influenceStart.end() - 1);
+
+    for (w = 0; w < (int)mesh.vindex.size(); w++)
+    {
+        if (mesh.vindex[w] >= 0 && mesh.vindex[w] < count && mesh.vbone[w] >= 0 && mesh.vbone[w] < numBones)
+        {
+            influences[cursor[mesh.vindex[w]]++] = w;
+        }
+    }
+
+    DTSTriangles triangles;
+
+    DTSMeshTools::expandTriangles(mesh, triangles);
+
+    // Every part fits when the whole mesh does.
+    if ((int)triangles.indices.size() > DTSMeshTools::MaxIndices)
+    {
+        return false;
+    }
+
+    int numTriangles = triangles.count();
+
+    stats.sourceDrawCalls = countMaterialRuns(triangles);
+
+    // Triangles around each vertex, to grow parts over connected surfaces.
+    std::vector<int> adjacencyStart(count + 1, 0), adjacency(numTriangles * 3);
+
+    for (size_t i = 0; i < triangles.indices.size(); i++)
+    {
+        adjacencyStart[triangles.indices[i] + 1]++;
+    }
+
+    for (v = 0; v < count; v++)
+    {
+        adjacencyStart[v + 1] += adjacencyStart[v];
+    }
+
+    cursor.assign(adjacencyStart.begin(), adjacencyStart.end() - 1);
+
+    for (size_t i = 0; i < triangles.indices.size(); i++)
+    {
+        adjacency[cursor[triangles.indices[i]]++] = (int)(i / 3);
+    }
+
+    std::vector<int>  trianglePart(numTriangles, -1);
+    std::vector<int>  bonePart(numBones, -1);
+    std::vector<int>  newBones;
+    std::vector<bool> queued(numTriangles, false);
+    int               numParts = 0, next = 0;
+
+    while (next < numTriangles)
+    {
+        if (trianglePart[next] != -1)
+        {
+            next++;
+            continue;
+        }
+
+        int              part = numParts++;
+        int              partBones = 0;
+        std::vector<int> queue(1, next);
+        size_t           head = 0;
+        int              scan = next;
+
+        queued[next] = true;
+
+        for (;;)
+        {
+            if (head == queue.size())
+            {
+                // Connected surface exhausted, look further down for triangles that still fit.
+                while (scan < numTriangles && (trianglePart[scan] != -1 || queued[scan]))
+                {
+                    scan++;
+                }
+
+                if (scan == numTriangles)
+                {
+                    break;
+                }
+
+                queue.push_back(scan);
+                queued[scan] = true;
+            }
+
+            int triangle = queue[head++];
+
+            newBones.clear();
+
+            for (int corner = 0; corner < 3; corner++)
+            {
+                int vertex = triangles.indices[triangle * 3 + corner];
+
+                for (int i = influenceStart[vertex]; i < influenceStart[vertex + 1]; i++)
+                {
+                    int bone = mesh.vbone[influences[i]];
+
+                    if (bonePart[bone] != part && std::find(newBones.begin(), newBones.end(), bone) == newBones.end())
+                    {
+                        newBones.push_back(bone);
+                    }
+                }
+            }
+
+            if (partBones + (int)newBones.size() > paletteSize && partBones > 0)
+            {
+                // Does not fit, left for a later part.
+                continue;
+            }
+
+            if ((int)newBones.size() > paletteSize)
+            {
+                stats.oversizedTriangles++;
+            }
+
+            trianglePart[triangle] = part;
+            partBones += (int)newBones.size();
+
+            for (size_t b = 0; b < newBones.size(); b++)
+            {
+                bonePart[newBones[b]] = part;
+            }
+
+            for (int corner = 0; corner < 3; corner++)
+            {
+                int vertex = triangles.indices[triangle * 3 + corner];
+
+                for (int a = adjacencyStart[vertex]; a < adjacencyStart[vertex + 1]; a++)
+                {
+                    if (trianglePart[adjacency[a]] == -1 && !queued[adjacency[a]])
+                    {
+                        queued[adjacency[a]] = true;
+                        queue.push_back(adjacency[a]);
+                    }
+                }
+            }
+        }
+
+        // Rejected triangles become candidates again for the next part.
+        for (size_t q = 0; q < queue.size(); q++)
+        {
+            queued[queue[q]] = false;
+        }
+    }
+
+    // Triangles of every part, in material order.
+    std::vector<int> order(numTriangles);
+
+    for (t = 0; t < numTriangles; t++)
+    {
+        order[t] = t;
+    }
+
+    std::stable_sort(order.begin(), order.end(), PartTriangleLess(trianglePart));
+
+    std::vector<int>  vertexRemap(count, -1), vertexPart(count, -1), boneRemap(numBones, -1), boneEmitted(numBones, -1);
+    std::vector<bool> referenced(count, false);
+
+    parts.resize(numParts);
+
+    for (int first = 0; first < numTriangles; )
+    {
+        int part = trianglePart[order[first]];
+        int end  = first;
+
+        while (end < numTriangles && trianglePart[order[end]] == part)
+        {
+            end++;
+        }
+
+        std::stable_sort(order.begin() + first, order.begin() + end, PartTriangleLess(triangles.materials));
+
+        DTSMesh&         result(parts[part]);
+        DTSTriangles     partTriangles;
+        std::vector<int> vertices;
+
+        for (t = first; t < end; t++)
+        {
+            for (int corner = 0; corner < 3; corner++)
+            {
+                int vertex = triangles.indices[order[t] * 3 + corner];
+
+                if (vertexPart[vertex] != part)
+                {
+                    vertexPart [vertex] = part;
+                    vertexRemap[vertex] = (int)vertices.size();
+                    vertices.push_back(vertex);
+                }
+
+                if (!referenced[vertex])
+                {
+                    referenced[vertex] = true;
+                    stats.vertices++;
+                }
+
+                partTriangles.indices.push_back(vertexRemap[vertex]);
+            }
+
+            partTriangles.materials.push_back(triangles.materials[order[t]]);
+        }
+
+        result.type          = mesh.type;
+        result.numFrames     = 1;
+        result.matFrames     = 1;
+        result.parent        = mesh.parent;
+        result.bounds        = mesh.bounds;
+        result.center        = mesh.center;
+        result.radius        = mesh.radius;
+        result.flags         = mesh.flags;
+        result.vertsPerFrame = (int)vertices.size();
+
+        for (size_t i = 0; i < vertices.size(); i++)
+        {
+            int source = vertices[i];
+
+            result.verts.push_back(mesh.verts[source]);
+
+            if (source < (int)mesh.tverts.size())   result.tverts  .push_back(mesh.tverts  [source]);
+            if (source < (int)mesh.normals.size())  result.normals .push_back(mesh.normals [source]);
+            if (source < (int)mesh.enormals.size()) result.enormals.push_back(mesh.enormals[source]);
+
+            // Compact joint remap, in order of first use.
+            for (int k = influenceStart[source]; k < influenceStart[source + 1]; k++)
+            {
+                int bone = mesh.vbone[influences[k]];
+
+                if (boneEmitted[bone] != part)
+                {
+                    boneEmitted[bone] = part;
+                    boneRemap[bone] = (int)result.nodeIndex.size();
+                    result.nodeIndex.push_back(mesh.nodeIndex[bone]);
+
+                    if (bone < (int)mesh.nodeTransform.size())
+                    {
+                        result.nodeTransform.push_back(mesh.nodeTransform[bone]);
+                    }
+                }
+
+                result.vindex .push_back((int)i);
+                result.vbone  .push_back(boneRemap[bone]);
+                result.vweight.push_back(mesh.vweight[influences[k]]);
+            }
+        }
+
+        result.primitives = mesh.primitives;
+        DTSMeshTools::setTriangles(result, partTriangles);
+
+        stats.drawCalls          += countMaterialRuns(partTriangles);
+        stats.duplicatedVertices += (int)vertices.size();
+
+        first = end;
+    }
+
+    stats.parts               = numParts;
+    stats.duplicatedVertices -= stats.vertices;
+
+    return true;
+}
@@ -0,0 +1,114 @@
+/*
+ * dts2fbx
+ * Copyright (c) 2011 Charlie Duhor. All rights reserved.
+ *
+ * @DTS2FBX_LICENSE_HEADER_START@
+ * 
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ * 
+ * @DTS2FBX_LICENSE_HEADER_START@
+ */
+
+#ifndef DTSConverter_DTSSkinning_h
+#define DTSConverter_DTSSkinning_h
+
+#include "DTSShape.h"
+
+#include <vector>
+#include <string>
+
+class DTSSkinStreams
+{
+public:
+    // Fixed width vertex attributes: influences joints[v * width + i] with
+    // weights[v * width + i] / 255, unused slots being joint 0 with weight 0.
+    int                         width;
+    std::vector<unsigned short> joints;
+    std::vector<unsigned char>  weights;
+
+public:
+    DTSSkinStreams() : width(0) {}
+};
+
+// Skin stream file layout, little endian:
+//
+//   char[4] "DSKN", u16 version, u16 numMeshes
+//   for every mesh:
+//     u16 name length, name, u32 numVertices, u8 width, u8 0
+//     u16 numBones, u16[numBones] shape node of every bone
+//     u16[numVertices * width] bones, u8[numVertices * width] weights
+//
+// Vertices follow the control points of the FBX mesh of the same name and
+// bones its skin clusters. Weights are in 1/255 and sum to 255, unused
+// slots being bone 0 with weight 0.
+class DTSSkinStreamFile
+{
+public:
+    std::vector<std::string>       names;
+    std::vector<std::vector<int> > bones;
+    std::vector<DTSSkinStreams>    streams;
+
+public:
+    // Adds the streams of a skinned mesh whose influences were already
+    // reduced to width by buildStreams and applyStreams.
+    void add(const std::string& name, const DTSMesh& mesh, int width);
+    bool write(const char* path) const;
+};
+
+class DTSInfluenceStats
+{
+public:
+    int   vertices;
+    int   prunedVertices;   // Vertices that had more than the allowed influences
+    int   prunedInfluences;
+    float maxError;         // Largest per vertex sum of weight differences
+    float avgError;
+
+public:
+    DTSInfluenceStats() : vertices(0), prunedVertices(0), prunedInfluences(0), maxError(0), avgError(0) {}
+};
+
+class DTSPaletteStats
+{
+public:
+    int parts;
+    int drawCalls;           // Material runs over all parts
+    int sourceDrawCalls;     // Material runs of the unsplit mesh
+    int vertices;            // Vertices referenced by the unsplit mesh
+    int duplicatedVertices;  // Extra copies of vertices shared between parts
+    int oversizedTriangles;  // Triangles alone needing more bones than the palette
+
+public:
+    DTSPaletteStats() : parts(0), drawCalls(0), sourceDrawCalls(0), vertices(0), duplicatedVertices(0), oversizedTriangles(0) {}
+};
+
+class DTSSkinning
+{
+public:
+    // Keeps the maxInfluences strongest influences of every vertex,
+    // renormalizes them and quantizes the weights to 8 bits.
+    static void buildStreams(const DTSMesh& mesh, int maxInfluences, DTSSkinStreams& streams, DTSInfluenceStats& stats);
+
+    // Replaces the influences of a skinned mesh by the content of the streams.
+    static void applyStreams(const DTSSkinStreams& streams, DTSMesh& mesh);
+
+    // Splits a skinned mesh into parts using at most paletteSize bones each.
+    // Every part has its own compact nodeIndex, vertices shared between parts
+    // being duplicated. Returns false when the mesh cannot be split.
+    static bool splitPalette(const DTSMesh& mesh, int paletteSize, std::vector<DTSMesh>& parts, DTSPaletteStats& stats);
+};
+
+#endif
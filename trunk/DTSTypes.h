@@ -43,6 +43,21 @@ public:
     float x, y, z, w;
 };
 
+// Rotation key as stored in shape files, components scaled by 32767.
+class Quat16
+{
+public:
+    short x, y, z, w;
+};
+
+// Translation key quantized over the range of its key run, see
+// DTSShape::translationRanges.
+class Point16
+{
+public:
+    unsigned short x, y, z;
+};
+
 class Box
 {
 public:
@@ -0,0 +1,392 @@
+/*
+ * dts2fbx
+ * Copyright (c) 2011 Charlie Duhor. All rights reserved.
+ *
+ * @DTS2FBX_LICENSE_HEADER_START@
+ * 
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ * 
+ * @DTS2FBX_LICENSE_HEADER_START@
+ */
+
+#include "DTSVertexCache.h"
+
+#include <math.h>
+#include <algorithm>
+
+static const int   CacheSize         = 32;
+static const float CacheDecayPower   = 1.5f;
+static const float LastTriangleScore = 0.75f;
+static const float ValenceBoostScale = 2.0f;
+static const float ValenceBoostPower = 0.5f;
+
+void DTSCacheStats::add(const DTSCacheStats& other)
+{
+    triangles  += other.triangles;
+    vertices   += other.vertices;
+    transforms += other.transforms;
+}
+
+void DTSVertexCache::measure(const DTSTriangles& triangles, int numVertices, DTSCacheStats& stats, int cacheSize)
+{
+    // A vertex is cached while fewer than cacheSize misses followed its own.
+    std::vector<int> missTime(numVertices, -1);
+    std::vector<bool> referenced(numVertices, false);
+
+    stats = DTSCacheStats();
+    stats.triangles = triangles.count();
+
+    for (size_t i = 0; i < triangles.indices.size(); i++)
+    {
+        int v = triangles.indices[i];
+
+        if (missTime[v] == -1 || stats.transforms - missTime[v] >= cacheSize)
+        {
+            missTime[v] = stats.transforms++;
+        }
+
+        if (!referenced[v])
+        {
+            referenced[v] = true;
+            stats.vertices++;
+        }
+    }
+}
+
+static float vertexScore(int cachePosition, int remaining)
+{
+    if (remaining == 0)
+    {
+        return -1;
+    }
+
+    float score = 0;
+
+    if (cachePosition >= 0)
+    {
+        if (cachePosition < 3)
+        {
+            // The last triangle's vertices, deliberately not the best.
+            score = LastTriangleScore;
+        }
+        else
+        {
+            score = powf(1.0f - (float)(cachePosition - 3) / (CacheSize - 3), CacheDecayPower);
+        }
+    }
+
+    return score + ValenceBoostScale * powf((float)remaining, -ValenceBoostPower);
+}
+
+static void reorderGroup(std::vector<int>& indices, int first, int count,
+                         std::vector<int>& adjacencyStart, std::vector<int>& remaining,
+                         std::vector<int>& cachePosition, std::vector<float>& score)
+{
+    const int* group = &indices[first * 3];
+    int        t, corner;
+
+    // Triangles around each vertex; only the vertices of the group are touched.
+    for (t = 0; t < count * 3; t++)
+    {
+        remaining[group[t]]++;
+    }
+
+    int total = 0;
+
+    for (t = 0; t < count * 3; t++)
+    {
+        int v = group[t];
+
+        if (adjacencyStart[v] == -1)
+        {
+            adjacencyStart[v] = total;
+            total += remaining[v];
+        }
+    }
+
+    std::vector<int>   adjacency(total);
+    std::vector<int>   used(total > 0 ? total : 1, 0);
+    std::vector<float> triangleScore(count);
+    std::vector<bool>  emitted(count, false);
+
+    for (t = 0; t < count; t++)
+    {
+        for (corner = 0; corner < 3; corner++)
+        {
+            int v = group[t * 3 + corner];
+
+            adjacency[adjacencyStart[v] + used[adjacencyStart[v]]++] = t;
+        }
+    }
+
+    for (t = 0; t < count * 3; t++)
+    {
+        score[group[t]] = vertexScore(-1, remaining[group[t]]);
+    }
+
+    int best = 0;
+
+    for (t = 0; t < count; t++)
+    {
+        triangleScore[t] = score[group[t * 3]] + score[group[t * 3 + 1]] + score[group[t * 3 + 2]];
+
+        if (triangleScore[t] > triangleScore[best])
+        {
+            best = t;
+        }
+    }
+
+    std::vector<int> output;
+    std::vector<int> cache, newCache;
+    int              cursor = 0;
+
+    output.reserve(count * 3);
+    cache .reserve(CacheSize + 3);
+
+    for (int emittedCount = 0; emittedCount < count; emittedCount++)
+    {
+        if (best == -1)
+        {
+            // Nothing left around the cache, continue in the original order.
+            while (emitted[cursor])
+            {
+                cursor++;
+            }
+
+            best = cursor;
+        }
+
+        emitted[best] = true;
+
+        newCache.clear();
+
+        for (corner = 0; corner < 3; corner++)
+        {
+            int  v     = group[best * 3 + corner];
+            int* list  = &adjacency[adjacencyStart[v]];
+            int  alive = remaining[v];
+
+            output.push_back(v);
+            newCache.push_back(v);
+
+            // Move the emitted triangle out of the live part of the list.
+            for (int k = 0; k < alive; k++)
+            {
+                if (list[k] == best)
+                {
+                    std::swap(list[k], list[alive - 1]);
+                    break;
+                }
+            }
+
+            remaining[v]--;
+        }
+
+        for (size_t k = 0; k < cache.size(); k++)
+        {
+            if (cache[k] != newCache[0] && cache[k] != newCache[1] && cache[k] != newCache[2])
+            {
+                newCache.push_back(cache[k]);
+            }
+        }
+
+        for (size_t k = 0; k < newCache.size(); k++)
+        {
+            cachePosition[newCache[k]] = k < (size_t)CacheSize ? (int)k : -1;
+        }
+
+        best = -1;
+
+        float bestScore = -1;
+
+        for (size_t k = 0; k < newCache.size(); k++)
+        {
+            int v = newCache[k];
+
+            score[v] = vertexScore(cachePosition[v], remaining[v]);
+        }
+
+        for (size_t k = 0; k < newCache.size(); k++)
+        {
+            int v = newCache[k];
+
+            for (int a = 0; a < remaining[v]; a++)
+            {
+                int triangle = adjacency[adjacencyStart[v] + a];
+
+                triangleScore[triangle] = score[group[triangle * 3]] + score[group[triangle * 3 + 1]] + score[group[triangle * 3 + 2]];
+
+                if (triangleScore[triangle] > bestScore)
+                {
+                    bestScore = triangleScore[triangle];
+                    best      = triangle;
+                }
+            }
+        }
+
+        if (newCache.size() > (size_t)CacheSize)
+        {
+            newCache.resize(CacheSize);
+        }
+
+        cache.swap(newCache);
+    }
+
+    // Reset the shared per-vertex state for the next group.
+    for (t = 0; t < count * 3; t++)
+    {
+        adjacencyStart[group[t]] = -1;
+        remaining     [group[t]] = 0;
+        cachePosition [group[t]] = -1;
+    }
+
+    std::copy(output.begin(), output.end(), indices.begin() + first * 3);
+}
+
+void DTSVertexCache::reorderTriangles(DTSTriangles& triangles, int numVertices)
+{
+    std::vector<int>   adjacencyStart(numVertices, -1);
+    std::vector<int>   remaining     (numVertices, 0);
+    std::vector<int>   cachePosition (numVertices, -1);
+    std::vector<float> score         (numVertices, 0);
+
+    for (int first = 0; first < triangles.count(); )
+    {
+        int end = first + 1;
+
+        while (end < triangles.count() && triangles.materials[end] == triangles.materials[first])
+        {
+            end++;
+        }
+
+        reorderGroup(triangles.indices, first, end - first, adjacencyStart, remaining, cachePosition, score);
+        first = end;
+    }
+}
+
+class MaterialLess
+{
+public:
+    const std::vector<int>& materials;
+
+    MaterialLess(const std::vector<int>& m) : materials(m) {}
+
+    bool operator()(int a, int b) const { return materials[a] < materials[b]; }
+};
+
+bool DTSVertexCache::optimize(DTSMesh& mesh, DTSCacheStats& before, DTSCacheStats& after)
+{
+    if ((mesh.type != DTSMesh::T_Standard && mesh.type != DTSMesh::T_Skin) ||
+        mesh.numFrames > 1 || mesh.matFrames > 1 || mesh.vertsPerFrame <= 0 ||
+        (int)mesh.verts.size() < mesh.vertsPerFrame)
+    {
+        return false;
+    }
+
+    int          count = mesh.vertsPerFrame;
+    DTSTriangles expanded, triangles;
+
+    DTSMeshTools::expandTriangles(mesh, expanded);
+
+    if ((int)expanded.indices.size() > DTSMeshTools::MaxIndices)
+    {
+        return false;
+    }
+
+    measure(expanded, count, before);
+
+    // Gather each material into a single run, keeping the triangle order within it.
+    std::vector<int> order(expanded.count());
+    int              t;
+
+    for (t = 0; t < expanded.count(); t++)
+    {
+        order[t] = t;
+    }
+
+    std::stable_sort(order.begin(), order.end(), MaterialLess(expanded.materials));
+
+    triangles.indices  .resize(expanded.indices.size());
+    triangles.materials.resize(expanded.materials.size());
+
+    for (t = 0; t < expanded.count(); t++)
+    {
+        for (int corner = 0; corner < 3; corner++)
+        {
+            triangles.indices[t * 3 + corner] = expanded.indices[order[t] * 3 + corner];
+        }
+
+        triangles.materials[t] = expanded.materials[order[t]];
+    }
+
+    reorderTriangles(triangles, count);
+
+    // Vertex fetch order: first use, unreferenced vertices last.
+    std::vector<int> remap(count, -1), vertices;
+    int              v;
+
+    vertices.reserve(count);
+
+    for (size_t i = 0; i < triangles.indices.size(); i++)
+    {
+        if (remap[triangles.indices[i]] == -1)
+        {
+            remap[triangles.indices[i]] = (int)vertices.size();
+            vertices.push_back(triangles.indices[i]);
+        }
+
+        triangles.indices[i] = remap[triangles.indices[i]];
+    }
+
+    for (v = 0; v < count; v++)
+    {
+        if (remap[v] == -1)
+        {
+            remap[v] = (int)vertices.size();
+            vertices.push_back(v);
+        }
+    }
+
+    std::vector<Point>         verts   (mesh.verts);
+    std::vector<Point2D>       tverts  (mesh.tverts);
+    std::vector<Point>         normals (mesh.normals);
+    std::vector<unsigned char> enormals(mesh.enormals);
+
+    for (v = 0; v < count; v++)
+    {
+        int source = vertices[v];
+
+        mesh.verts[v] = verts[source];
+
+        if (source < (int)tverts.size())   mesh.tverts  [v] = tverts  [source];
+        if (source < (int)normals.size())  mesh.normals [v] = normals [source];
+        if (source < (int)enormals.size()) mesh.enormals[v] = enormals[source];
+    }
+
+    for (size_t w = 0; w < mesh.vindex.size(); w++)
+    {
+        if (mesh.vindex[w] >= 0 && mesh.vindex[w] < count)
+        {
+            mesh.vindex[w] = remap[mesh.vindex[w]];
+        }
+    }
+
+    mesh.mindices.clear();
+    DTSMeshTools::setTriangles(mesh, triangles);
+
+    measure(triangles, count, after);
+    return true;
+}
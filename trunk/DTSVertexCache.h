@@ -0,0 +1,67 @@
+/*
+ * dts2fbx
+ * Copyright (c) 2011 Charlie Duhor. All rights reserved.
+ *
+ * @DTS2FBX_LICENSE_HEADER_START@
+ * 
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ * 
+ * @DTS2FBX_LICENSE_HEADER_START@
+ */
+
+#ifndef DTSConverter_DTSVertexCache_h
+#define DTSConverter_DTSVertexCache_h
+
+#include "DTSShape.h"
+#include "DTSMeshTools.h"
+
+class DTSCacheStats
+{
+public:
+    int triangles;
+    int vertices;    // Distinct vertices referenced
+    int transforms;  // Cache misses
+
+public:
+    DTSCacheStats() : triangles(0), vertices(0), transforms(0) {}
+
+    void add(const DTSCacheStats& other);
+
+    // Average cache miss ratio (transforms per triangle) and average
+    // transform to vertex ratio.
+    float acmr() const { return triangles ? (float)transforms / triangles : 0; }
+    float atvr() const { return vertices  ? (float)transforms / vertices  : 0; }
+};
+
+class DTSVertexCache
+{
+public:
+    enum { FIFOSize = 16 };
+
+    // Simulates a FIFO post-transform cache over a triangle list.
+    static void measure(const DTSTriangles& triangles, int numVertices, DTSCacheStats& stats, int cacheSize = FIFOSize);
+
+    // Forsyth style triangle reordering, run separately on every run of
+    // equal materials so material boundaries stay where they are.
+    static void reorderTriangles(DTSTriangles& triangles, int numVertices);
+
+    // Reorders the triangles of a mesh for the vertex cache, then
+    // renumbers its vertices in order of first use. Returns false for
+    // meshes it does not handle (animated vertices, sorted, decals).
+    static bool optimize(DTSMesh& mesh, DTSCacheStats& before, DTSCacheStats& after);
+};
+
+#endif
@@ -26,7 +26,9 @@
 #include <stdio.h>
 #include <assert.h>
 #include <vector>
+#include <string>
 #include <errno.h>
+#include <string.h>
 
 #ifndef WIN32
 #include <glob.h>
@@ -35,6 +37,14 @@
 #include "DTSTypes.h"
 #include "DTSBase.h"
 #include "DTSShape.h"
+#include "DTSSimplify.h"
+#include "DTSMeshTools.h"
+#include "DTSVertexCache.h"
+#include "DTSAnalysis.h"
+#include "DTSSkinning.h"
+#include "DTSExportOptions.h"
+#include "DTSSkeleton.h"
+#include "DTSClip.h"
 
 int info(FILE* fileOut, DTSShape& shape)
 {
@@ -190,11 +200,9 @@ int info(FILE* fileOut, DTSShape& shape)
     if (shape.nodeRotations.size() > 0)
     {
         fprintf(fileOut, "\nNode rotations:\n========================\n");
-        std::vector<Quaternion>::const_iterator it, end(shape.nodeRotations.end());
-        
-        for (it = shape.nodeRotations.begin(), index = 0; it != end; ++it, ++index)
+        for (index = 0; index < (int)shape.nodeRotations.size(); index++)
         {
-            const Quaternion& q(*it);
+            Quaternion q(shape.nodeRotation(index));
             
             fprintf(fileOut, "  #%i: %f %f %f %f\n", index, q.x, q.y, q.z, q.w);
         }
@@ -203,11 +211,9 @@ int info(FILE* fileOut, DTSShape& shape)
     if (shape.nodeTranslations.size() > 0)
     {
         fprintf(fileOut, "\nNode translations:\n========================\n");
-        std::vector<Point>::const_iterator it, end(shape.nodeTranslations.end());
-        
-        for (it = shape.nodeTranslations.begin(), index = 0; it != end; ++it, ++index)
+        for (index = 0; index < (int)shape.nodeTranslations.size(); index++)
         {
-            const Point& q(*it);
+            Point q(shape.nodeTranslation(index));
             
             fprintf(fileOut, "  #%i: %f %f %f\n", index, q.x, q.y, q.z);
         }
@@ -370,16 +376,213 @@ int info(FILE* fileOut, DTSShape& shape)
     return 0;
 }
 
-int convert(const DTSResolver&, const DTSShape& shape, const std::vector<DTSShape>& files, const char* fbxFile, bool addAnim);
+int convert(const DTSResolver&, const DTSShape& shape, const std::vector<DTSShape>& files, const char* fbxFile, bool addAnim, const DTSExportOptions& options, const char* animOutput);
+int exportAnimations(const DTSShape& shape, const std::vector<DTSShape>& files, const char* directory, const DTSExportOptions& options);
 
 int main (int argc, const char * argv[])
 {
+    /********************
+     * Read Options     *
+     ********************/
+    std::vector<const char*> args;
+    DTSDetailSelection       detailSelection;
+    bool                     selectDetails = false;
+    std::vector<float>       simplifyRatios;
+    float                    weldEpsilon = -1;
+    bool                     optimizeCache = false;
+    bool                     analyze = false;
+    int                      maxInfluences = 0;
+    DTSExportOptions         exportOptions;
+    bool                     pruneSkeleton = false;
+    float                    clipError = 0.001f;
+    const char*              animOutput = NULL;
+    bool                     inPlace = false;
+
+    for (int index = 0; index < argc; index++)
+    {
+        if (strncmp(argv[index], "--lod=", 6) == 0)
+        {
+            if (!detailSelection.parse(argv[index] + 6))
+            {
+                fprintf(stderr, "Invalid detail level selection %s\n", argv[index]);
+                return -1;
+            }
+
+            selectDetails = true;
+        }
+        else if (strcmp(argv[index], "--weld") == 0)
+        {
+            weldEpsilon = 1e-5f;
+        }
+        else if (strncmp(argv[index], "--weld=", 7) == 0)
+        {
+            weldEpsilon = (float)atof(argv[index] + 7);
+
+            if (weldEpsilon < 0)
+            {
+                fprintf(stderr, "Invalid weld epsilon %s\n", argv[index]);
+                return -1;
+            }
+        }
+        else if (strcmp(argv[index], "--analyze") == 0)
+        {
+            analyze = true;
+        }
+        else if (strncmp(argv[index], "--max-influences=", 17) == 0)
+        {
+            maxInfluences = atoi(argv[index] + 17);
+
+            if (maxInfluences < 1 || maxInfluences > 16)
+            {
+                fprintf(stderr, "Invalid influence count %s\n", argv[index]);
+                return -1;
+            }
+
+            exportOptions.maxInfluences = maxInfluences;
+        }
+        else if (strncmp(argv[index], "--palette=", 10) == 0)
+        {
+            exportOptions.paletteSize = atoi(argv[index] + 10);
+
+            if (exportOptions.paletteSize < 1)
+            {
+                fprintf(stderr, "Invalid bone palette size %s\n", argv[index]);
+                return -1;
+            }
+        }
+        else if (strcmp(argv[index], "--merge-static") == 0 || strcmp(argv[index], "--merge-static=node") == 0)
+        {
+            exportOptions.mergeStatic = true;
+            exportOptions.mergeByNode = strcmp(argv[index], "--merge-static=node") == 0;
+        }
+        else if (strcmp(argv[index], "--instance") == 0)
+        {
+            exportOptions.instance = true;
+        }
+        else if (strcmp(argv[index], "--reduce-keys") == 0)
+        {
+            exportOptions.translationTolerance = 0.001f;
+            exportOptions.rotationTolerance    = 0.1f;
+        }
+        else if (strncmp(argv[index], "--reduce-keys=", 14) == 0)
+        {
+            if (sscanf(argv[index] + 14, "%f,%f", &exportOptions.translationTolerance, &exportOptions.rotationTolerance) != 2 ||
+                exportOptions.translationTolerance < 0 || exportOptions.rotationTolerance < 0)
+            {
+                fprintf(stderr, "Invalid keyframe tolerances %s\n", argv[index]);
+                return -1;
+            }
+        }
+        else if (strncmp(argv[index], "--fps=", 6) == 0)
+        {
+            exportOptions.fps = (float)atof(argv[index] + 6);
+
+            if (exportOptions.fps <= 0)
+            {
+                fprintf(stderr, "Invalid frame rate %s\n", argv[index]);
+                return -1;
+            }
+        }
+        else if (strncmp(argv[index], "--screen-height=", 16) == 0)
+        {
+            exportOptions.screenHeight = (float)atof(argv[index] + 16);
+
+            if (exportOptions.screenHeight <= 0)
+            {
+                fprintf(stderr, "Invalid screen height %s\n", argv[index]);
+                return -1;
+            }
+        }
+        else if (strncmp(argv[index], "--clip-error=", 13) == 0)
+        {
+            clipError = (float)atof(argv[index] + 13);
+
+            if (clipError <= 0)
+            {
+                fprintf(stderr, "Invalid clip error %s\n", argv[index]);
+                return -1;
+            }
+        }
+        else if (strncmp(argv[index], "--anim-output=", 14) == 0 && argv[index][14])
+        {
+            animOutput = argv[index] + 14;
+        }
+        else if (strcmp(argv[index], "--in-place") == 0)
+        {
+            inPlace = true;
+        }
+        else if (strcmp(argv[index], "--prune-skeleton") == 0)
+        {
+            pruneSkeleton = true;
+        }
+        else if (strcmp(argv[index], "--optimize-cache") == 0)
+        {
+            optimizeCache = true;
+        }
+        else if (strncmp(argv[index], "--simplify=", 11) == 0)
+        {
+            const char* ratio = argv[index] + 11;
+            char*       end;
+
+            for (;;)
+            {
+                float value = (float)strtod(ratio, &end);
+
+                if (end == ratio || value <= 0 || value >= 1 || (*end != ',' && *end != 0))
+                {
+                    fprintf(stderr, "Invalid simplification ratio in %s\n", argv[index]);
+                    return -1;
+                }
+
+                simplifyRatios.push_back(value);
+
+                if (*end == 0)
+                {
+                    break;
+                }
+
+                ratio = end + 1;
+            }
+        }
+        else if (strncmp(argv[index], "--", 2) == 0)
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[index]);
+            return -1;
+        }
+        else
+        {
+            args.push_back(argv[index]);
+        }
+    }
+
+    argc = (int)args.size();
+    argv = &args[0];
+
     if (argc < 3)
     {
         fprintf(stderr, "Syntax:\n");
-        fprintf(stderr, "  %s info    file.dts\n", argv[0]);
-        fprintf(stderr, "  %s convert file.fbx file.dts [file.dsq ...]\n", argv[0]);
-        fprintf(stderr, "  %s addanim file.fbx file.dts [file.dsq ...]\n", argv[0]);
+        fprintf(stderr, "  %s info    [--analyze] file.dts\n", argv[0]);
+        fprintf(stderr, "  %s convert [options] file.fbx file.dts [file.dsq ...]\n", argv[0]);
+        fprintf(stderr, "  %s addanim [options] file.fbx file.dts [file.dsq ...]\n", argv[0]);
+        fprintf(stderr, "  %s export-anims [options] directory file.dts [file.dsq ...]\n", argv[0]);
+        fprintf(stderr, "  %s export-clips [options] directory file.dts [file.dsq ...]\n", argv[0]);
+        fprintf(stderr, "Options:\n");
+        fprintf(stderr, "  --lod=<index|name|all|highest>[,...]  only export the given detail levels\n");
+        fprintf(stderr, "  --screen-height=<pixels>              screen height the LOD thresholds are computed for (default 1080)\n");
+        fprintf(stderr, "  --simplify=<ratio>[,...]              add simplified detail levels keeping the given triangle ratios\n");
+        fprintf(stderr, "  --weld[=<epsilon>]                    merge duplicate vertices (default epsilon 1e-5)\n");
+        fprintf(stderr, "  --optimize-cache                      reorder triangles and vertices for the GPU vertex cache\n");
+        fprintf(stderr, "  --max-influences=<n>                  keep n bone influences per vertex, with 8-bit weights, also written to file.skin\n");
+        fprintf(stderr, "  --palette=<n>                         split skinned meshes using more than n bones\n");
+        fprintf(stderr, "  --merge-static[=node]                 merge static meshes per detail level and material (and node)\n");
+        fprintf(stderr, "  --instance                            export identical static meshes once, as instances\n");
+        fprintf(stderr, "  --prune-skeleton                      drop nodes that are neither skinned, animated nor carrying objects\n");
+        fprintf(stderr, "  --reduce-keys[=<units>,<degrees>]     drop keyframes within the given tolerances (default 0.001,0.1)\n");
+        fprintf(stderr, "  --fps=<n>                             resample sequences to n keys per second\n");
+        fprintf(stderr, "  --clip-error=<units>                  with export-clips, world space error budget (default 0.001)\n");
+        fprintf(stderr, "  --anim-output=<file.fbx>              with addanim, the animation file to update (default file@anims.fbx)\n");
+        fprintf(stderr, "  --in-place                            with addanim, load and rewrite the whole target file instead\n");
+        fprintf(stderr, "  --analyze                             with info, print mesh performance metrics as JSON\n");
         return -1;
     }
     
@@ -406,7 +609,17 @@ int main (int argc, const char * argv[])
         }
         
         fclose(f);
-        
+
+        if (analyze)
+        {
+            std::vector<DTSMeshMetrics> metrics;
+
+            shape.hashMeshes();
+            DTSAnalysis::analyze(shape, metrics);
+            DTSAnalysis::writeJSON(stdout, shape, metrics);
+            return 0;
+        }
+
         return info(stdout, shape);
     }
 
@@ -422,9 +635,60 @@ int main (int argc, const char * argv[])
         return -1;
     }
     
-    shape.loadShapeFile(f);
+    shape.loadShapeFile(f, selectDetails ? &detailSelection : NULL);
     fclose(f);
 
+    if (weldEpsilon >= 0)
+    {
+        for (size_t mesh = 0; mesh < shape.meshes.size(); mesh++)
+        {
+            DTSMeshTools::weldVertices(shape.meshes[mesh], weldEpsilon);
+        }
+    }
+
+    if (!simplifyRatios.empty())
+    {
+        DTSSimplifier::generateDetailLevels(shape, simplifyRatios);
+    }
+
+    if (maxInfluences > 0)
+    {
+        for (size_t mesh = 0; mesh < shape.meshes.size(); mesh++)
+        {
+            if (shape.meshes[mesh].type != DTSMesh::T_Skin)
+            {
+                continue;
+            }
+
+            DTSSkinStreams    streams;
+            DTSInfluenceStats stats;
+
+            DTSSkinning::buildStreams(shape.meshes[mesh], maxInfluences, streams, stats);
+            DTSSkinning::applyStreams(streams, shape.meshes[mesh]);
+
+            printf("Mesh #%i: %i of %i vertices pruned (%i influences), weight error avg %f max %f\n",
+                   (int)mesh, stats.prunedVertices, stats.vertices, stats.prunedInfluences, stats.avgError, stats.maxError);
+        }
+    }
+
+    if (optimizeCache)
+    {
+        DTSCacheStats before, after;
+
+        for (size_t mesh = 0; mesh < shape.meshes.size(); mesh++)
+        {
+            DTSCacheStats meshBefore, meshAfter;
+
+            if (DTSVertexCache::optimize(shape.meshes[mesh], meshBefore, meshAfter))
+            {
+                before.add(meshBefore);
+                after .add(meshAfter);
+            }
+        }
+
+        printf("Vertex cache: ACMR %.3f -> %.3f, ATVR %.3f -> %.3f\n", before.acmr(), after.acmr(), before.atvr(), after.atvr());
+    }
+
     /********************
      * Read Sequences   *
      ********************/
@@ -470,16 +734,61 @@ int main (int argc, const char * argv[])
 #endif
     }
 
+    if (pruneSkeleton)
+    {
+        int numNodes = (int)shape.nodes.size();
+        int removed  = DTSSkeleton::prune(shape, sequenceFiles);
+
+        printf("Skeleton: removed %i of %i nodes\n", removed, numNodes);
+    }
+
+    // Only instancing uses the content hashes, taken once the meshes are final.
+    if (exportOptions.instance)
+    {
+        shape.hashMeshes();
+    }
+
     /**********************
      * Perform Operations *
      **********************/
     if (strcmp(argv[1], "convert") == 0)
     {
-        return convert(resolver, shape, sequenceFiles, argv[2], false);
+        return convert(resolver, shape, sequenceFiles, argv[2], false, exportOptions, NULL);
     }
     else if (strcmp(argv[1], "addanim") == 0)
     {
-        return convert(resolver, shape, sequenceFiles, argv[2], true);
+        std::string animFile;
+
+        if (!inPlace)
+        {
+            if (animOutput)
+            {
+                animFile = animOutput;
+            }
+            else
+            {
+                size_t length = strlen(argv[2]);
+
+                animFile = argv[2];
+
+                if (length > 4 && (strcmp(argv[2] + length - 4, ".fbx") == 0 || strcmp(argv[2] + length - 4, ".FBX") == 0))
+                {
+                    animFile.erase(length - 4);
+                }
+
+                animFile += "@anims.fbx";
+            }
+        }
+
+        return convert(resolver, shape, sequenceFiles, argv[2], true, exportOptions, inPlace ? NULL : animFile.c_str());
+    }
+    else if (strcmp(argv[1], "export-anims") == 0)
+    {
+        return exportAnimations(shape, sequenceFiles, argv[2], exportOptions);
+    }
+    else if (strcmp(argv[1], "export-clips") == 0)
+    {
+        return DTSClipCompressor::exportClips(shape, sequenceFiles, argv[2], clipError);
     }
     else
     {